@@ -0,0 +1,457 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "rasserts.hpp"
+
+using namespace std;
+
+
+#define POOL_BUFFER_SIZE ((size_t) 64 * 1024)  // размер больших буферов (совпадает с CHUNK_SIZE): их берём из регионов пула
+#define POOL_REGION_BUFFERS 1024  // сколько больших буферов в одном регионе (1024 * 64 КБ = 64 МБ)
+#define POOL_MAX_PENDING 65536  // сколько освобождённых буферов может ждать потока очистки (65536 * 64 КБ = 4 ГБ)
+#define POOL_REGION_SIZE (POOL_REGION_BUFFERS * POOL_BUFFER_SIZE)
+#define POOL_SHM_RESERVE ((size_t) 1 << 40)  // сколько адресов резервируем под регионы в разделяемой памяти (1 ТБ)
+#define POOL_SMALL_MIN ((size_t) 64)  // самый маленький буфер (совпадает с CHUNK_MIN_CAP)
+#define POOL_SMALL_CLASSES 10  // размеры маленьких буферов в разделяемой памяти: POOL_SMALL_MIN << k байт, k = 0..9 (см. chunk_cap)
+#define POOL_SHARDS_PER_NODE 4  // на сколько частей (по номеру ядра) делим свободные большие буферы одного узла NUMA
+#define POOL_MAX_SHARDS 256
+#define POOL_STEAL 64  // сколько свободных буферов забираем за раз у другой части, когда в своей пусто
+
+
+
+// === Освобождённый буфер, который ещё не вернули системе ===
+struct dead_buffer {
+    uint8_t *bytes;
+    size_t cap;
+};
+
+
+
+// Число узлов NUMA (1 - если система не NUMA или узнать не удалось): /sys/devices/system/node/online - это список вида "0-1"
+static size_t numa_nodes() {
+    FILE *f = fopen("/sys/devices/system/node/online", "r");
+    if (f == NULL)
+        return 1;
+    size_t nodes = 1, a, b;
+    int c;
+    while (fscanf(f, "%zu", &a) == 1) {
+        b = a;
+        if ((c = fgetc(f)) == '-' && fscanf(f, "%zu", &b) == 1)
+            c = fgetc(f);
+        nodes = max(nodes, b + 1);
+        if (c != ',')
+            break;
+    }
+    fclose(f);
+    return nodes;
+}
+
+
+
+// === Часть списка свободных больших буферов - своя у каждой группы ядер ===
+struct pool_shard {
+    mutex m;
+    vector <uint8_t*> free_list;  // свободные большие буферы (их память уже отдана системе)
+};
+
+
+
+// === Пул буферов данных с фоновой очисткой ===
+// Большие буферы нарезаются из регионов, выделенных через mmap; маленькие - обычный new[].
+// Освобождение буфера - это только постановка в ограниченную очередь: поток очистки пачками возвращает
+// память больших буферов системе (madvise(MADV_DONTNEED), соседние буферы - одним вызовом) и кладёт их
+// обратно в список свободных, а маленькие удаляет через delete[]. Так удаление большого файла не держит поток запросов.
+// После MADV_DONTNEED страницы читаются как нули, поэтому любой большой буфер из пула уже занулён.
+// Все методы можно вызывать из любого потока. Поток очистки запускает start() - до этого буферы просто копятся в очереди.
+//
+// Режим разделяемой памяти (attach_shm): регионы - это подряд идущие части именованного объекта shm_open, отображённые
+// подряд в заранее зарезервированный диапазон адресов, поэтому буфер однозначно задаётся смещением от shm_base.
+// Маленькие буферы тогда тоже берутся из регионов: большой буфер делится на буферы одного размера (размер - по номеру класса),
+// освобождённые маленькие буферы возвращаются в список своего класса, а память больших отдаётся через fallocate(PUNCH_HOLE).
+// Объект переживает процесс: новый процесс отображает его заново и по смещениям (см. adopt_shm) получает те же байты без копирования.
+//
+// Свободные большие буферы разложены по частям (shards): у каждого узла NUMA POOL_SHARDS_PER_NODE частей, поток берёт буферы
+// из части своего узла и ядра (getcpu), поэтому параллельные потоки импорта не стоят в очереди к одной блокировке.
+// Память свободного буфера уже отдана системе, так что его страницы выделит ядро ОС на узле того, кто первым в него запишет.
+struct BufferPool {
+    vector <uint8_t*> regions;
+    mutex regions_m;  // защищает regions: новый регион может понадобиться сразу нескольким потокам
+    vector <pool_shard*> shards;
+    int shm_fd;  // -1 - обычная память процесса
+    uint8_t *shm_base;  // начало зарезервированного диапазона: регион i лежит по адресу shm_base + i * POOL_REGION_SIZE
+    vector <uint8_t*> small_free[POOL_SMALL_CLASSES];  // только в разделяемой памяти: свободные маленькие буферы по классам
+    bool keep;  // пул отпущен (detach): освобождаемые буферы больше не трогаем - их байты нужны следующему процессу
+
+    mutex m;  // защищает всё, кроме reaper и shards (их блокировки берутся только после m или без неё)
+    condition_variable cv;
+    vector <dead_buffer> pending;  // освобождённые буферы, которые ещё не разобрал поток очистки
+    size_t pending_bytes;
+    size_t reclaimed_bytes;  // сколько байт всего разобрал поток очистки
+    bool stop;
+    thread reaper;
+
+    BufferPool() {
+        pending_bytes = reclaimed_bytes = 0;
+        stop = false;
+        shm_fd = -1;
+        shm_base = NULL;
+        keep = false;
+        size_t count = min(numa_nodes() * POOL_SHARDS_PER_NODE, (size_t) POOL_MAX_SHARDS);
+        for (size_t i = 0; i < count; i ++)
+            shards.push_back(new pool_shard());
+    }
+
+    void start() {  // из того процесса, который будет обслуживать ФС: при уходе в фон fuse_main делает fork, а потоки fork не переживают
+        if (reaper.joinable() == false)
+            reaper = thread(&BufferPool::reaper_loop, this);
+    }
+
+    // Класс маленького буфера на cap байт (cap - степень двойки от POOL_SMALL_MIN до POOL_BUFFER_SIZE / 2)
+    static size_t small_class(size_t cap) {
+        size_t k = 0;
+        while ((POOL_SMALL_MIN << k) < cap)
+            k += 1;
+        return k;
+    }
+
+    // Подключаем объект разделяемой памяти name (вида "/имя") - до первого alloc. Если keep_data - оставляем то, что в нём
+    // лежит (дальше adopt_shm), иначе обнуляем. Объект блокируется: второй процесс с тем же именем подключиться не сможет
+    bool attach_shm(const char *name, bool keep_data) {
+        int fd = shm_open(name, O_RDWR | O_CREAT, 0600);
+        if (fd < 0)
+            return false;
+        struct stat st;
+        if (flock(fd, LOCK_EX | LOCK_NB) != 0 || fstat(fd, &st) != 0 || (keep_data == false && ftruncate(fd, 0) != 0)) {
+            close(fd);
+            return false;
+        }
+        size_t size = keep_data ? st.st_size : 0;
+        if (size % POOL_REGION_SIZE != 0 || size > POOL_SHM_RESERVE) {
+            close(fd);
+            errno = EINVAL;  // объект создан не нами (или с другим размером региона)
+            return false;
+        }
+        void *base = map_aligned(POOL_SHM_RESERVE, PROT_NONE, MAP_NORESERVE);
+        if (base == MAP_FAILED) {
+            close(fd);
+            return false;
+        }
+        shm_fd = fd;
+        shm_base = (uint8_t *) base;
+        for (size_t i = 0; i < size / POOL_REGION_SIZE; i ++)
+            map_region();
+        return true;
+    }
+
+    // Анонимное отображение size байт, выровненное по POOL_REGION_SIZE: тогда адрес / POOL_REGION_SIZE - это номер региона
+    // (см. home_shard). Берём на регион больше и отрезаем лишнее с обеих сторон
+    static void *map_aligned(size_t size, int prot, int flags) {
+        void *res = mmap(NULL, size + POOL_REGION_SIZE, prot, flags | MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (res == MAP_FAILED)
+            return MAP_FAILED;
+        uintptr_t start = (uintptr_t) res, aligned = (start + POOL_REGION_SIZE - 1) / POOL_REGION_SIZE * POOL_REGION_SIZE;
+        if (aligned > start)
+            munmap(res, aligned - start);
+        if (start + POOL_REGION_SIZE > aligned)
+            munmap((void *) (aligned + size), start + POOL_REGION_SIZE - aligned);
+        return (void *) aligned;
+    }
+
+    // Отображаем следующий регион (в разделяемой памяти - очередную часть объекта)
+    uint8_t *map_region() {
+        lock_guard <mutex> lock(regions_m);
+        void *region;
+        if (shm_fd < 0) {
+            region = map_aligned(POOL_REGION_SIZE, PROT_READ | PROT_WRITE, 0);
+        } else {
+            off_t off = regions.size() * POOL_REGION_SIZE;
+            rassert(off + POOL_REGION_SIZE <= POOL_SHM_RESERVE, "Закончился диапазон адресов разделяемой памяти!");
+            struct stat st;
+            rassert(fstat(shm_fd, &st) == 0, "Не удалось узнать размер разделяемой памяти!");
+            if (st.st_size < off + (off_t) POOL_REGION_SIZE)
+                rassert(ftruncate(shm_fd, off + POOL_REGION_SIZE) == 0, "Не удалось увеличить разделяемую память!");
+            region = mmap(shm_base + off, POOL_REGION_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, shm_fd, off);
+        }
+        rassert(region != MAP_FAILED, "Не удалось выделить память под буферы данных!");
+        regions.push_back((uint8_t *) region);
+        return (uint8_t *) region;
+    }
+
+    // Часть, из которой берёт буферы вызывающий поток
+    size_t my_shard() {
+        unsigned cpu = 0, node = 0;
+        if (shards.size() == 1 || syscall(SYS_getcpu, &cpu, &node, NULL) != 0)
+            return 0;
+        return (node * POOL_SHARDS_PER_NODE + cpu % POOL_SHARDS_PER_NODE) % shards.size();
+    }
+
+    // Часть, в которую возвращается освобождённый буфер: по номеру региона (регионы выровнены, см. map_aligned) -
+    // весь регион в одну, чтобы соседние буферы оставались рядом
+    size_t home_shard(const uint8_t *bytes) {
+        return ((uintptr_t) bytes / POOL_REGION_SIZE) % shards.size();
+    }
+
+    // Пополняем пустую часть: забираем буферы у другой части, а если свободных нет нигде - отображаем новый регион
+    void refill(pool_shard *shard) {
+        vector <uint8_t*> got;
+        for (pool_shard *other: shards) {
+            if (other == shard)
+                continue;
+            lock_guard <mutex> lock(other->m);  // две блокировки частей сразу не держим - иначе две пустые части могут ждать друг друга
+            size_t take = min(other->free_list.size(), (size_t) POOL_STEAL);
+            got.assign(other->free_list.end() - take, other->free_list.end());
+            other->free_list.resize(other->free_list.size() - take);
+            if (take > 0)
+                break;
+        }
+
+        if (got.size() == 0) {
+            uint8_t *region = map_region();
+            for (size_t i = POOL_REGION_BUFFERS; i > 0; i --)  // с начала региона - так соседние буферы чаще освобождаются вместе
+                got.push_back(region + (i - 1) * POOL_BUFFER_SIZE);
+        }
+        lock_guard <mutex> lock(shard->m);
+        shard->free_list.insert(shard->free_list.end(), got.begin(), got.end());
+    }
+
+    uint8_t *alloc_big() {  // в разделяемой памяти - под m
+        pool_shard *shard = shards[my_shard()];
+        while (1) {
+            {
+                lock_guard <mutex> lock(shard->m);
+                if (shard->free_list.size() > 0) {
+                    uint8_t *bytes = shard->free_list.back();
+                    shard->free_list.pop_back();
+                    return bytes;
+                }
+            }
+            refill(shard);  // другой поток мог успеть забрать пополнение - тогда ещё круг
+        }
+    }
+
+    void free_big(vector <uint8_t*> &big) {  // буферы одного региона в big идут подряд
+        for (size_t i = 0; i < big.size(); ) {
+            size_t j = i + 1;
+            size_t k = home_shard(big[i]);
+            while (j < big.size() && home_shard(big[j]) == k)
+                j += 1;
+            lock_guard <mutex> lock(shards[k]->m);
+            shards[k]->free_list.insert(shards[k]->free_list.end(), big.begin() + i, big.begin() + j);
+            i = j;
+        }
+    }
+
+    // Сколько свободных больших буферов во всех частях
+    size_t free_big_count() {
+        size_t count = 0;
+        for (pool_shard *shard: shards) {
+            lock_guard <mutex> lock(shard->m);
+            count += shard->free_list.size();
+        }
+        return count;
+    }
+
+    // Новый буфер на cap байт; большие буферы уже занулены
+    uint8_t *alloc(size_t cap) {
+        if (cap != POOL_BUFFER_SIZE && shm_fd < 0)
+            return new uint8_t[cap];
+        if (shm_fd < 0)
+            return alloc_big();
+
+        lock_guard <mutex> lock(m);  // в разделяемой памяти регионы идут строго подряд - их отображаем по одному
+        if (cap == POOL_BUFFER_SIZE)
+            return alloc_big();
+
+        vector <uint8_t*> &list = small_free[small_class(cap)];
+        if (list.size() == 0) {  // делим большой буфер на маленькие этого класса
+            uint8_t *page = alloc_big();
+            for (size_t i = POOL_BUFFER_SIZE / cap; i > 0; i --)
+                list.push_back(page + (i - 1) * cap);
+        }
+        uint8_t *bytes = list.back();
+        list.pop_back();
+        return bytes;
+    }
+
+    // Смещение буфера в объекте разделяемой памяти и обратно (NULL - такого буфера в объекте нет)
+    uint64_t shm_offset(const uint8_t *bytes) {
+        return bytes - shm_base;
+    }
+
+    uint8_t *shm_buffer(uint64_t off, size_t cap) {
+        if (cap < POOL_SMALL_MIN || cap > POOL_BUFFER_SIZE || (cap & (cap - 1)) != 0 || off % cap != 0 || off + cap > regions.size() * POOL_REGION_SIZE)
+            return NULL;
+        return shm_base + off;
+    }
+
+    // После подключения объекта с данными: used - буферы, которые снова заняты (их нашли по смещениям), всё остальное - свободно.
+    // Большой буфер, поделённый на маленькие, принадлежит классу своих занятых буферов; полностью свободные большие буферы зануляем
+    bool adopt_shm(const vector <dead_buffer> &used) {
+        size_t count = regions.size() * POOL_REGION_BUFFERS;
+        vector <int> page_class(count, -1);  // -1 - свободен, POOL_SMALL_CLASSES - занят целиком, иначе - класс маленьких буферов
+        vector <bool> taken;  // занятые буферы: номер = смещение / POOL_SMALL_MIN
+        taken.resize(count * (POOL_BUFFER_SIZE / POOL_SMALL_MIN), false);
+        for (const dead_buffer &buf: used) {
+            uint64_t off = shm_offset(buf.bytes);
+            size_t page = off / POOL_BUFFER_SIZE;
+            int cls = buf.cap == POOL_BUFFER_SIZE ? POOL_SMALL_CLASSES : (int) small_class(buf.cap);
+            if ((page_class[page] != -1 && page_class[page] != cls) || taken[off / POOL_SMALL_MIN])
+                return false;  // один и тот же буфер занят дважды или большой буфер поделён на разные классы
+            page_class[page] = cls;
+            taken[off / POOL_SMALL_MIN] = true;
+        }
+
+        lock_guard <mutex> lock(m);
+        vector <uint8_t*> big;
+        for (size_t page = count; page > 0; page --) {  // с конца - так первыми выдаются буферы из начала объекта
+            uint8_t *bytes = shm_base + (page - 1) * POOL_BUFFER_SIZE;
+            int cls = page_class[page - 1];
+            if (cls == -1) {
+                big.push_back(bytes);
+            } else if (cls < POOL_SMALL_CLASSES) {
+                size_t cap = POOL_SMALL_MIN << cls;
+                for (size_t i = POOL_BUFFER_SIZE / cap; i > 0; i --)
+                    if (taken[(shm_offset(bytes) + (i - 1) * cap) / POOL_SMALL_MIN] == false)
+                        small_free[cls].push_back(bytes + (i - 1) * cap);
+            }
+        }
+        for (size_t i = 0; i < count; ) {  // в свободных буферах остались старые байты - отдаём их память
+            size_t j = i;
+            while (j < count && page_class[j] == -1)
+                j += 1;
+            if (j > i)
+                zero_big(shm_base + i * POOL_BUFFER_SIZE, j - i);
+            i = j + 1;
+        }
+        free_big(big);
+        return true;
+    }
+
+    // Отпускаем пул: объект разделяемой памяти со всеми байтами остаётся следующему процессу
+    void detach() {
+        lock_guard <mutex> lock(m);
+        keep = true;
+    }
+
+    // Отдаём буферы потоку очистки; если очередь переполнена - ждём, пока он её разгребёт
+    void release(vector <dead_buffer> &bufs) {
+        if (bufs.size() == 0)
+            return;
+        unique_lock <mutex> lock(m);
+        if (keep) {
+            bufs.clear();
+            return;
+        }
+        if (reaper.joinable())  // поток очистки ещё не запущен - ждать некого
+            cv.wait(lock, [this] { return pending.size() < POOL_MAX_PENDING; });
+        for (dead_buffer &buf: bufs) {
+            pending.push_back(buf);
+            pending_bytes += buf.cap;
+        }
+        bufs.clear();
+        cv.notify_all();
+    }
+
+    void release(uint8_t *bytes, size_t cap) {
+        vector <dead_buffer> bufs = {{bytes, cap}};
+        release(bufs);
+    }
+
+    // Сколько байт освобождено, но ещё не возвращено системе
+    size_t pending_size() {
+        lock_guard <mutex> lock(m);
+        return pending_bytes;
+    }
+
+    void reaper_loop() {
+        while (1) {
+            vector <dead_buffer> batch;
+            {
+                unique_lock <mutex> lock(m);
+                cv.wait(lock, [this] { return stop || pending.size() > 0; });
+                if (pending.size() == 0)
+                    return;  // stop и делать больше нечего
+                batch.swap(pending);
+                cv.notify_all();  // место в очереди освободилось
+            }
+
+            vector <uint8_t*> big;
+            vector <dead_buffer> small;  // только в разделяемой памяти
+            size_t bytes = 0;
+            for (dead_buffer &buf: batch) {
+                bytes += buf.cap;
+                if (buf.cap == POOL_BUFFER_SIZE)
+                    big.push_back(buf.bytes);
+                else if (shm_fd >= 0)
+                    small.push_back(buf);
+                else
+                    delete[] buf.bytes;
+            }
+
+            sort(big.begin(), big.end());  // соседние в памяти буферы отдаём системе одним вызовом
+            for (size_t i = 0; i < big.size(); ) {
+                size_t j = i + 1;
+                while (j < big.size() && big[j] == big[j-1] + POOL_BUFFER_SIZE)
+                    j += 1;
+                zero_big(big[i], j - i);
+                i = j;
+            }
+
+            lock_guard <mutex> lock(m);
+            free_big(big);
+            for (dead_buffer &buf: small)
+                small_free[small_class(buf.cap)].push_back(buf.bytes);
+            pending_bytes -= bytes;
+            reclaimed_bytes += bytes;
+        }
+    }
+
+    // Отдаём системе память count соседних больших буферов; после этого они читаются как нули
+    void zero_big(uint8_t *bytes, size_t count) {
+        size_t len = count * POOL_BUFFER_SIZE;
+        int res;
+        if (shm_fd < 0)
+            res = madvise(bytes, len, MADV_DONTNEED);
+        else  // у MAP_SHARED страницы остаются в объекте - освобождаем их в нём самом
+            res = fallocate(shm_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, shm_offset(bytes), len);
+        if (res != 0)
+            memset(bytes, 0, len);  // память останется у нас, но буферы всё равно должны быть нулевыми
+    }
+
+    ~BufferPool() {
+        {
+            lock_guard <mutex> lock(m);
+            stop = true;
+            cv.notify_all();
+        }
+        if (reaper.joinable())
+            reaper.join();  // поток успевает разобрать всю очередь
+        else
+            reaper_loop();  // потока так и не было - разбираем очередь сами
+        for (pool_shard *shard: shards)
+            delete shard;
+        if (shm_fd >= 0) {
+            munmap(shm_base, POOL_SHM_RESERVE);  // сам объект остаётся (или удаляется - см. shm_unlink у владельца)
+            close(shm_fd);
+            return;
+        }
+        for (uint8_t *region: regions)
+            munmap(region, POOL_REGION_SIZE);
+    }
+};
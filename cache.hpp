@@ -0,0 +1,68 @@
+#pragma once
+
+#include <time.h>
+#include <vector>
+
+using namespace std;
+
+
+#define WHEEL_SLOTS 1024  // количество ячеек колеса таймеров; одна ячейка - одна секунда
+#define WHEEL_RETRY 1  // через сколько секунд снова пробуем удалить файл, если в срок его удалить было нельзя
+
+
+
+// === Запись в колесе таймеров: inode num должна истечь в момент expire ===
+struct wheel_entry {
+    int num;
+    time_t expire;
+};
+
+
+
+// === Колесо таймеров для времени жизни (TTL) файлов ===
+// Запись кладётся в ячейку expire % WHEEL_SLOTS; за один оборот колеса срабатывают только те записи ячейки,
+// чей срок уже наступил, остальные ждут следующих оборотов. Отменять записи не нужно: тот, кто достаёт
+// сработавшие записи, сам сверяет их с текущим сроком inode (номер inode мог освободиться или срок - поменяться).
+struct TimerWheel {
+    vector <vector <wheel_entry>> slots;
+    time_t now;  // до какой секунды (включительно) колесо уже провёрнуто
+    size_t count;  // сколько записей в колесе
+
+    TimerWheel() {
+        slots.resize(WHEEL_SLOTS);
+        now = time(NULL);
+        count = 0;
+    }
+
+    void add(int num, time_t expire, time_t check_at=0) {  // check_at - не раньше какого момента достать запись (повтор)
+        time_t at = max(expire, check_at);
+        at = at > now ? at : now + 1;  // уже истёкшие сработают при ближайшем повороте
+        slots[at % WHEEL_SLOTS].push_back({num, expire});
+        count += 1;
+    }
+
+    // Проворачиваем колесо до момента t и возвращаем все записи, чей срок наступил
+    vector <wheel_entry> advance(time_t t) {
+        vector <wheel_entry> res;
+        if (t <= now || count == 0) {
+            now = max(now, t);
+            return res;
+        }
+
+        time_t steps = min(t - now, (time_t) WHEEL_SLOTS);  // больше одного оборота смотреть незачем
+        for (time_t sec = now + 1; sec <= now + steps; sec ++) {
+            vector <wheel_entry> &slot = slots[sec % WHEEL_SLOTS];
+            size_t kept = 0;
+            for (size_t i = 0; i < slot.size(); i ++) {
+                if (slot[i].expire <= t)
+                    res.push_back(slot[i]);
+                else
+                    slot[kept++] = slot[i];  // срок в одном из следующих оборотов
+            }
+            slot.resize(kept);
+        }
+        count -= res.size();
+        now = t;
+        return res;
+    }
+};
@@ -0,0 +1,204 @@
+#pragma once
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <algorithm>
+
+#include "common.hpp"
+
+using namespace std;
+
+
+#define CHANGES_PATH "/.changes"  // виртуальный файл журнала изменений в корне ФС
+#define CHANGES_DEFAULT_RING 65536  // сколько последних изменений хранится по умолчанию
+
+
+
+// === Одна запись журнала изменений ===
+struct change_record {
+    uint64_t seq;  // номер записи: растёт на 1 с каждым изменением, начиная с 1
+    const char *op;  // create, mkdir, link, unlink, rmdir, evict, rename, write, truncate, attrib
+    int ino;  // inode, которую изменили
+    int parent;  // директория, в которой она лежит (для rename - старая)
+    string path;
+    int new_parent;  // только для rename
+    string new_path;
+    off_t off;  // write: изменённый диапазон [off, off + len); truncate: новый размер в off
+    size_t len;
+};
+
+
+
+// === Состояние одного открытия журнала: с какого места читать и какое поддерево интересует ===
+struct change_reader {
+    uint64_t cursor;  // последняя уже просмотренная запись
+    string subtree;  // "/" - все изменения
+};
+
+
+
+// === Журнал изменений: кольцевой буфер последних записей ===
+// Запись номер seq лежит в ring[seq % ring.size()]; когда буфер заполнен, новая запись затирает самую старую.
+// Читатель, отставший больше, чем на размер буфера, получает строку overflow и должен пересканировать ФС.
+struct ChangeFeed {
+    vector <change_record> ring;  // пустой - журнал выключен
+    uint64_t next_seq;  // номер следующей записи
+    uint64_t delivered;  // записи с номерами до delivered кто-то уже прочитал - их нельзя дополнять
+
+    ChangeFeed() {
+        next_seq = 1;
+        delivered = 0;
+    }
+
+    void enable(size_t ring_size) {
+        ring.resize(ring_size);
+    }
+
+    bool enabled() {
+        return ring.size() > 0;
+    }
+
+    uint64_t first_seq() {  // самая старая запись, которая ещё есть в буфере
+        return next_seq > ring.size() ? next_seq - ring.size() : 1;
+    }
+
+    // Добавляем запись; строки в слотах буфера переиспользуются, поэтому после заполнения буфера память почти не выделяется
+    void add(const char *op, int ino, int parent, const char *path, off_t off = 0, size_t len = 0,
+             int new_parent = -1, const char *new_path = "") {
+        if (enabled() == false)
+            return;
+        change_record &rec = ring[next_seq % ring.size()];
+        rec.seq = next_seq;
+        rec.op = op;
+        rec.ino = ino;
+        rec.parent = parent;
+        rec.path = path;
+        rec.new_parent = new_parent;
+        rec.new_path = new_path;
+        rec.off = off;
+        rec.len = len;
+        next_seq += 1;
+    }
+
+    // Запись в файл: подряд идущие записи в одну inode, которые ещё никто не прочитал, сливаем в одну
+    void add_write(int ino, int parent, const char *path, off_t off, size_t len) {
+        if (enabled() == false)
+            return;
+        if (next_seq > 1 && next_seq - 1 > delivered) {
+            change_record &last = ring[(next_seq - 1) % ring.size()];
+            off_t end = last.off + (off_t) last.len;
+            if (last.op == string_view("write") && last.ino == ino && off <= end && off + (off_t) len >= last.off) {
+                last.len = max(end, off + (off_t) len) - min(last.off, off);
+                last.off = min(last.off, off);
+                return;
+            }
+        }
+        add("write", ino, parent, path, off, len);
+    }
+
+    // Новый читатель начинает с самой старой из оставшихся записей
+    change_reader *open_reader() {
+        change_reader *reader = new change_reader();
+        reader->cursor = first_seq() - 1;
+        reader->subtree = "/";
+        return reader;
+    }
+
+    // Команды читателя (по одной в строке): "from N" - продолжить после записи N, "subtree /путь" - только изменения в поддереве
+    bool command(change_reader *reader, string_view cmd) {
+        while (cmd.size() > 0) {
+            size_t end = min(cmd.find('\n'), cmd.size());
+            string_view line = cmd.substr(0, end);
+            cmd.remove_prefix(min(end + 1, cmd.size()));
+            if (line.size() == 0)
+                continue;
+            if (line.substr(0, 5) == "from ") {
+                string num(line.substr(5));
+                char *tail;
+                uint64_t cursor = strtoull(num.c_str(), &tail, 10);
+                if (num.size() == 0 || isdigit((unsigned char) num[0]) == 0 || *tail != 0 || cursor >= next_seq)
+                    return false;  // записи N ещё не было - иначе читатель молча пропустил бы всё до неё
+                reader->cursor = cursor;  // если запись N уже затёрта, ближайшее чтение начнётся со строки overflow
+            } else if (line.substr(0, 8) == "subtree ") {
+                reader->subtree = construct_path(string(line.substr(8)).c_str());
+                if (reader->subtree.size() == 0 || reader->subtree[0] != '/')
+                    return false;
+            } else {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool in_subtree(const string &path, const string &subtree) {
+        if (subtree == "/")
+            return true;
+        return path.compare(0, subtree.size(), subtree) == 0 && (path.size() == subtree.size() || path[subtree.size()] == '/');
+    }
+
+    // Путь в записи: пробелы, переводы строк и '\' заменяем на \ooo (как в /proc/mounts), чтобы строку можно было разбить по пробелам
+    static void append_path(string &out, const string &path) {
+        for (char c: path) {
+            if (c == ' ' || c == '\t' || c == '\n' || c == '\\') {
+                char esc[8];
+                snprintf(esc, sizeof(esc), "\\%03o", (unsigned char) c);
+                out += esc;
+            } else {
+                out += c;
+            }
+        }
+    }
+
+    static string render(const change_record &rec) {
+        char head[128];
+        snprintf(head, sizeof(head), "%llu %s %d %d ", (unsigned long long) rec.seq, rec.op, rec.ino, rec.parent);
+        string line = head;
+        append_path(line, rec.path);
+        if (rec.op == string_view("rename")) {
+            line += " " + to_string(rec.new_parent) + " ";
+            append_path(line, rec.new_path);
+        } else if (rec.op == string_view("write")) {
+            line += " " + to_string(rec.off) + " " + to_string(rec.len);
+        } else if (rec.op == string_view("truncate")) {
+            line += " " + to_string(rec.off);
+        }
+        return line + "\n";
+    }
+
+    // Заполняем buf (не больше size байт, только целыми строками) записями после reader->cursor из его поддерева;
+    // если нужные записи уже затёрты - первой строкой идёт "N overflow", где N - последняя потерянная запись
+    size_t read(change_reader *reader, char *buf, size_t size) {
+        size_t done = 0;
+        if (reader->cursor + 1 < first_seq()) {
+            string line = to_string(first_seq() - 1) + " overflow\n";
+            if (line.size() > size)
+                return 0;
+            memcpy(buf, line.data(), line.size());
+            done = line.size();
+            reader->cursor = first_seq() - 1;
+        }
+
+        while (reader->cursor + 1 < next_seq) {
+            const change_record &rec = ring[(reader->cursor + 1) % ring.size()];
+            if (in_subtree(rec.path, reader->subtree) || (rec.new_path.size() > 0 && in_subtree(rec.new_path, reader->subtree))) {
+                string line = render(rec);
+                if (line.size() > size)
+                    line = to_string(rec.seq) + " overflow\n";  // запись не влезает даже в пустой буфер читателя - считаем её потерянной
+                if (done + line.size() > size)
+                    break;  // остальное - при следующем чтении
+                memcpy(buf + done, line.data(), line.size());
+                done += line.size();
+            }
+            reader->cursor += 1;
+            delivered = max(delivered, reader->cursor);
+        }
+        return done;
+    }
+};
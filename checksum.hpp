@@ -0,0 +1,210 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+using namespace std;
+
+
+#define CRC32C_POLY 0x82F63B78u  // многочлен Castagnoli (CRC32C) в отражённой записи
+
+
+
+// === CRC32C ===
+// crc32c(crc, buf, len) продолжает контрольную сумму crc (0 - начало) байтами buf, как в zlib.
+// На x86-64 с SSE4.2 считаем инструкцией crc32 по 8 байт за раз, иначе - по таблице.
+// crc32c_combine склеивает суммы двух соседних кусков данных, не читая сами данные: так сумма файла
+// собирается из сумм его кусков (способ из zlib - умножение на x^(8 * len) по модулю многочлена).
+
+struct crc32c_table {
+    uint32_t t[256];
+
+    crc32c_table() {
+        for (uint32_t i = 0; i < 256; i ++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k ++)
+                c = c & 1 ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+            t[i] = c;
+        }
+    }
+};
+
+static uint32_t crc32c_soft(uint32_t crc, const uint8_t *buf, size_t len) {
+    static const crc32c_table table;  // статическая переменная функции инициализируется потокобезопасно
+    for (size_t i = 0; i < len; i ++)
+        crc = table.t[(crc ^ buf[i]) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hard(uint32_t crc, const uint8_t *buf, size_t len) {
+    uint64_t c = crc;
+    for (; len >= 8; buf += 8, len -= 8) {
+        uint64_t word;
+        memcpy(&word, buf, 8);  // buf может быть не выровнен
+        c = _mm_crc32_u64(c, word);
+    }
+    uint32_t c32 = (uint32_t) c;
+    for (; len > 0; buf ++, len --)
+        c32 = _mm_crc32_u8(c32, *buf);
+    return c32;
+}
+#endif
+
+static uint32_t crc32c(uint32_t crc, const uint8_t *buf, size_t len) {
+#if defined(__x86_64__)
+    static const bool hard = __builtin_cpu_supports("sse4.2");
+    if (hard)
+        return ~crc32c_hard(~crc, buf, len);
+#endif
+    return ~crc32c_soft(~crc, buf, len);
+}
+
+// a * b по модулю многочлена (оба - многочлены в отражённой записи)
+static uint32_t crc32c_multmodp(uint32_t a, uint32_t b) {
+    uint32_t m = 1u << 31, p = 0;
+    while (1) {
+        if (a & m) {
+            p ^= b;
+            if ((a & (m - 1)) == 0)
+                break;
+        }
+        m >>= 1;
+        b = b & 1 ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+    }
+    return p;
+}
+
+struct crc32c_powers {
+    uint32_t x2n[64];  // x2n[k] = x^(2^k) по модулю многочлена
+
+    crc32c_powers() {
+        uint32_t p = 1u << 30;  // x^1
+        for (int k = 0; k < 64; k ++) {
+            x2n[k] = p;
+            p = crc32c_multmodp(p, p);
+        }
+    }
+};
+
+// x^(8 * len) по модулю многочлена - "сдвиг" суммы на len байт
+static uint32_t crc32c_shift(size_t len) {
+    static const crc32c_powers powers;
+    uint32_t p = 1u << 31;  // x^0
+    for (int k = 3; len > 0; len >>= 1, k ++)  // 8 * len = len << 3
+        if (len & 1)
+            p = crc32c_multmodp(powers.x2n[k], p);
+    return p;
+}
+
+// Сумма данных A+B по суммам A и B (len_b - длина B)
+static uint32_t crc32c_combine(uint32_t crc_a, uint32_t crc_b, size_t len_b) {
+    return crc32c_multmodp(crc32c_shift(len_b), crc_a) ^ crc_b;
+}
+
+// То же, если shift = crc32c_shift(len_b) уже посчитан (длина B всегда одна и та же)
+static uint32_t crc32c_combine_shifted(uint32_t crc_a, uint32_t crc_b, uint32_t shift) {
+    return crc32c_multmodp(shift, crc_a) ^ crc_b;
+}
+
+// Сумма len нулевых байт (дыр и хвостов кусков) - без самих нулей
+static uint32_t crc32c_zeros(size_t len) {
+    return crc32c_multmodp(crc32c_shift(len), 0xffffffffu) ^ 0xffffffffu;
+}
+
+
+
+// === Задание на проверку одного куска ===
+struct scrub_job {
+    void *owner;  // кусок; поток проверки это поле не трогает
+    const uint8_t *bytes;  // пока задание не завершено, буфер никто не меняет и не освобождает
+    size_t len;
+    uint32_t crc;  // результат: сумма len байт буфера
+};
+
+
+
+// === Поток проверки: считает суммы кусков, которые ему выдал поток запросов ===
+// Сравнивает результат с сохранённой суммой сам поток запросов (см. ChunkStore::reap_scrub) - здесь только счёт.
+struct Scrubber {
+    mutex m;  // защищает todo, done и stop
+    condition_variable cv;
+    vector <scrub_job*> todo;
+    vector <scrub_job*> done;
+    bool stop;
+    thread worker;
+
+    Scrubber() {
+        stop = false;
+    }
+
+    void start() {  // см. BufferPool::start
+        if (worker.joinable() == false)
+            worker = thread(&Scrubber::worker_loop, this);
+    }
+
+    void submit(vector <scrub_job*> &jobs) {
+        if (jobs.size() == 0)
+            return;
+        lock_guard <mutex> lock(m);
+        todo.insert(todo.end(), jobs.begin(), jobs.end());
+        jobs.clear();
+        cv.notify_one();
+    }
+
+    vector <scrub_job*> take_done() {
+        lock_guard <mutex> lock(m);
+        vector <scrub_job*> res;
+        res.swap(done);
+        return res;
+    }
+
+    void worker_loop() {
+        while (1) {
+            vector <scrub_job*> batch;
+            {
+                unique_lock <mutex> lock(m);
+                cv.wait(lock, [this] { return stop || todo.size() > 0; });
+                if (todo.size() == 0)
+                    return;  // stop и делать больше нечего
+                batch.swap(todo);
+            }
+
+            for (scrub_job *job: batch)
+                job->crc = crc32c(0, job->bytes, job->len);
+
+            lock_guard <mutex> lock(m);
+            done.insert(done.end(), batch.begin(), batch.end());
+        }
+    }
+
+    // Останавливаем поток (он успевает проверить всё, что ему выдали; если потока не было - проверяем сами)
+    void shutdown() {
+        {
+            lock_guard <mutex> lock(m);
+            if (stop)
+                return;
+            stop = true;
+            cv.notify_one();
+        }
+        if (worker.joinable())
+            worker.join();
+        else
+            worker_loop();
+    }
+
+    ~Scrubber() {
+        shutdown();
+    }
+};
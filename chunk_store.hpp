@@ -0,0 +1,469 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <string>
+
+#include "rasserts.hpp"
+#include "spill.hpp"
+#include "buffer_pool.hpp"
+#include "checksum.hpp"
+
+using namespace std;
+
+
+#define CHUNK_SIZE ((size_t) 64 * 1024)  // размер одного куска данных файла (в байтах)
+#define CHUNK_MIN_CAP ((size_t) 64)  // меньше этого буфер куска не бывает
+
+static_assert(CHUNK_SIZE == POOL_BUFFER_SIZE, "Полные куски должны браться из регионов пула буферов");
+static_assert(CHUNK_MIN_CAP == POOL_SMALL_MIN, "Маленькие буферы в разделяемой памяти делятся по тем же размерам, что и куски");
+
+#define CHUNK_RESIDENT 0  // байты куска в памяти
+#define CHUNK_WRITING 1  // байты куска в памяти, но уже записываются в файл вытеснения
+#define CHUNK_SPILLED 2  // байты куска только в файле вытеснения
+
+#define SCRUB_MAX_BATCH ((size_t) 64 * 1024 * 1024)  // сколько байт кусков выдаём потоку проверки за раз
+
+
+// Сколько памяти выделять куску, в котором нужно хранить need байт: степень двойки от CHUNK_MIN_CAP до CHUNK_SIZE.
+// Так маленькие файлы не занимают целый кусок, а дописываемые в конец растут с амортизированно константной ценой
+static size_t chunk_cap(size_t need) {
+    size_t cap = CHUNK_MIN_CAP;
+    while (cap < need && cap < CHUNK_SIZE)
+        cap *= 2;
+    return cap;
+}
+
+
+
+// === Кусок данных файла ===
+// Один и тот же кусок может разделяться несколькими файлами (после copy_range) - тогда refs > 1,
+// и перед записью в такой кусок мы делаем себе его копию (copy-on-write)
+struct chunk {
+    size_t refs;  // количество файлов (точнее, позиций в файлах), которые ссылаются на этот кусок
+    uint8_t *bytes;  // cap байт данных, байты дальше cap (до CHUNK_SIZE) считаются нулями; NULL, если кусок вытеснен
+    size_t cap;
+    int state;  // CHUNK_RESIDENT / CHUNK_WRITING / CHUNK_SPILLED
+    size_t slot;  // слот в файле вытеснения с актуальной копией куска (NO_SLOT - копии нет или она устарела)
+    spill_job *job;  // незавершённая запись этого куска в файл вытеснения
+    chunk *lru_prev, *lru_next;  // место в LRU-списке кусков, чьи байты в памяти
+    uint32_t crc;  // CRC32C всех cap байт буфера, если crc_valid
+    bool crc_valid;  // false - после последней записи сумму ещё не считали
+    bool corrupt;  // проверка нашла, что байты не совпадают с суммой (повреждение памяти)
+    size_t pins;  // сколько фоновых заданий (проверка, запись в нижнюю директорию) сейчас читают буфер; на каждое - лишняя ссылка
+    size_t scrub_pass;  // в каком проходе проверки кусок последний раз выдавали потоку проверки
+
+    chunk() {
+        refs = 1;
+        bytes = NULL;
+        cap = 0;
+        state = CHUNK_RESIDENT;
+        slot = NO_SLOT;
+        job = NULL;
+        lru_prev = lru_next = NULL;
+        crc = 0;
+        crc_valid = false;
+        corrupt = false;
+        pins = 0;
+        scrub_pass = 0;
+    }
+};
+
+
+
+// === Хранилище кусков: выделяет и освобождает куски, следит за тем, сколько их в памяти ===
+// Если задан файл вытеснения и лимит, то при превышении лимита давно не использованные куски
+// асинхронно уходят в файл, а при следующем обращении синхронно читаются обратно.
+// Буферы берутся из пула (buffer_pool.hpp); освобождённые буферы копятся в dead и в конце операции
+// одной пачкой уходят потоку очистки - счётчики при этом уменьшаются сразу.
+// У каждого куска есть CRC32C его буфера: запись только помечает сумму устаревшей, а считается она при запросе
+// суммы файла (checksum) или потоком проверки, который заодно сверяет с суммами давно не менявшиеся куски (см. scrub).
+struct ChunkStore {
+    chunk lru;  // фиктивная голова LRU-списка: lru.lru_next - самый свежий кусок, lru.lru_prev - самый старый
+    size_t limit;  // сколько байт кусков можно держать в памяти (0 - без ограничений, вытеснения нет)
+    size_t resident;  // сколько байт занимают буферы кусков в памяти
+    size_t stored;  // сколько байт занимают все куски (в памяти и вытесненные)
+    size_t spilled;  // сколько байт сейчас только в файле вытеснения
+    size_t in_flight;  // сколько байт сейчас записываются
+    size_t spill_outs;  // сколько раз кусок был вытеснен
+    size_t spill_ins;  // сколько раз кусок был прочитан обратно из файла вытеснения
+    size_t spill_errors;  // сколько раз вытесненный кусок не удалось прочитать (операция вернула EIO)
+    SpillFile *spill;
+    BufferPool pool;
+    vector <dead_buffer> dead;  // освобождённые за текущую операцию буферы (см. reclaim)
+
+    Scrubber *scrubber;  // NULL - фоновой проверки нет
+    time_t scrub_period;  // за сколько секунд проверяем все куски в памяти
+    time_t scrub_last;  // когда последний раз выдавали куски потоку проверки
+    chunk *scrub_cursor;  // следующий кусок прохода: идём по LRU-списку от самых старых
+    size_t scrub_pass;  // номер текущего прохода
+    size_t scrub_jobs;  // сколько заданий сейчас у потока проверки
+    size_t scrub_bytes, scrub_sealed, scrub_errors;  // сколько проверено байт, сколько сумм посчитано впервые, сколько найдено повреждений
+
+    ChunkStore() {
+        lru.lru_prev = lru.lru_next = &lru;
+        limit = resident = stored = spilled = in_flight = spill_outs = spill_ins = spill_errors = 0;
+        spill = NULL;
+        scrubber = NULL;
+        scrub_period = scrub_last = 0;
+        scrub_cursor = &lru;
+        scrub_pass = 0;  // первый проход начнётся при первом шаге проверки
+        scrub_jobs = scrub_bytes = scrub_sealed = scrub_errors = 0;
+    }
+
+    // Включаем вытеснение: path - директория или файл для вытесненных кусков, limit_bytes - сколько данных держим в памяти
+    bool enable_spill(const char *path, size_t limit_bytes) {
+        spill = new SpillFile();
+        if (spill->open_file(path, CHUNK_SIZE) == false) {
+            delete spill;
+            spill = NULL;
+            return false;
+        }
+        limit = max(limit_bytes, CHUNK_SIZE);
+        return true;
+    }
+
+    uint8_t *new_buffer(size_t cap) {
+        resident += cap;
+        return pool.alloc(cap);
+    }
+
+    void free_buffer(uint8_t *bytes, size_t cap) {
+        resident -= cap;
+        dead.push_back({bytes, cap});
+    }
+
+    // Запускаем фоновые потоки (очистки, вытеснения, проверки) - уже в процессе, который обслуживает ФС
+    void start_threads() {
+        pool.start();
+        if (spill != NULL)
+            spill->start();
+        if (scrubber != NULL)
+            scrubber->start();
+    }
+
+    // Отдаём освобождённые буферы потоку очистки
+    void reclaim() {
+        pool.release(dead);
+    }
+
+    void lru_remove(chunk *c) {
+        if (c->lru_next == NULL)
+            return;
+        if (scrub_cursor == c)
+            scrub_cursor = c->lru_prev;  // курсор прохода проверки переходим на следующий кусок
+        c->lru_prev->lru_next = c->lru_next;
+        c->lru_next->lru_prev = c->lru_prev;
+        c->lru_prev = c->lru_next = NULL;
+    }
+
+    void lru_touch(chunk *c) {  // делаем кусок самым свежим
+        lru_remove(c);
+        c->lru_next = lru.lru_next;
+        c->lru_prev = &lru;
+        lru.lru_next->lru_prev = c;
+        lru.lru_next = c;
+    }
+
+    // Новый кусок с буфером на cap байт; если zero - байты зануляем
+    chunk *alloc(size_t cap, bool zero) {
+        chunk *c = new chunk();
+        c->bytes = new_buffer(cap);
+        c->cap = cap;
+        if (zero && cap != POOL_BUFFER_SIZE)  // большие буферы пул выдаёт уже занулёнными
+            memset(c->bytes, 0, cap);
+        stored += cap;
+        lru_touch(c);
+        return c;
+    }
+
+    // Новый кусок из готового буфера на cap байт (выделенного через pool.alloc(cap)) - забираем его себе без копирования
+    chunk *adopt(uint8_t *bytes, size_t cap) {
+        chunk *c = new chunk();
+        c->bytes = bytes;
+        c->cap = cap;
+        resident += cap;
+        stored += cap;
+        lru_touch(c);
+        return c;
+    }
+
+    // Отпускаем ссылку на кусок: если ссылок не осталось - освобождаем память и место в файле вытеснения
+    void put(chunk *c) {
+        if (c == NULL)
+            return;
+        rassert(c->refs > 0, "Отпускаем кусок, на который никто не ссылается!");
+        c->refs -= 1;
+        if (c->refs > 0)
+            return;
+
+        if (c->job != NULL)
+            c->job->owner = NULL;  // буфер задания и его слот освободятся, когда запись завершится
+        if (c->state == CHUNK_RESIDENT && c->bytes != NULL)
+            free_buffer(c->bytes, c->cap);
+        if (c->state == CHUNK_SPILLED)
+            spilled -= c->cap;
+        if (c->slot != NO_SLOT)
+            spill->free_slot(c->slot);
+        lru_remove(c);
+        stored -= c->cap;
+        delete c;
+    }
+
+    // Байты куска: вытесненный кусок читаем обратно. Если for_write - копия в файле вытеснения устаревает,
+    // а если кусок прямо сейчас записывается - даём ему новый буфер (старый принадлежит заданию до его завершения).
+    // NULL - вытесненный кусок не удалось прочитать (кусок остаётся вытесненным, вызывающий вернёт EIO)
+    uint8_t *data(chunk *c, bool for_write) {
+        if (c->state == CHUNK_SPILLED) {
+            uint8_t *bytes = new_buffer(c->cap);
+            if (spill->read_slot(c->slot, bytes, c->cap) == false) {
+                free_buffer(bytes, c->cap);
+                spill_errors += 1;
+                return NULL;
+            }
+            c->bytes = bytes;
+            c->state = CHUNK_RESIDENT;
+            spilled -= c->cap;
+            spill_ins += 1;
+        } else if (c->state == CHUNK_WRITING && for_write) {
+            uint8_t *bytes = new_buffer(c->cap);
+            memcpy(bytes, c->bytes, c->cap);
+            c->bytes = bytes;
+            c->state = CHUNK_RESIDENT;
+        }
+
+        if (for_write)
+            c->crc_valid = false;
+        if (for_write && c->slot != NO_SLOT) {
+            spill->free_slot(c->slot);
+            c->slot = NO_SLOT;
+        }
+        lru_touch(c);
+        return c->bytes;
+    }
+
+    // Буфер куска будет читать фоновое задание (запись в нижнюю директорию): лишняя ссылка не даёт писать в этот буфер
+    // (запись сделает копию куска), а pins - вытеснять его. Вытесненный кусок сначала читаем обратно; NULL - не удалось
+    const uint8_t *pin(chunk *c) {
+        const uint8_t *bytes = data(c, false);
+        if (bytes == NULL)
+            return NULL;
+        c->refs += 1;
+        c->pins += 1;
+        return bytes;
+    }
+
+    void unpin(chunk *c) {  // задание завершено
+        c->pins -= 1;
+        put(c);
+    }
+
+    // Увеличиваем буфер куска, чтобы в нём помещалось need байт; кусок должен быть уже получен через data(c, true)
+    uint8_t *grow(chunk *c, size_t need) {
+        size_t cap = chunk_cap(need);
+        if (cap <= c->cap)
+            return c->bytes;
+        uint8_t *bytes = new_buffer(cap);
+        memcpy(bytes, c->bytes, c->cap);
+        memset(bytes + c->cap, 0, cap - c->cap);
+        free_buffer(c->bytes, c->cap);
+        stored += cap - c->cap;
+        c->bytes = bytes;
+        c->cap = cap;
+        return bytes;
+    }
+
+    // CRC32C буфера куска (cap байт) в res; устаревшую сумму пересчитываем. false - вытесненный кусок не удалось прочитать
+    bool checksum(chunk *c, uint32_t &res) {
+        if (c->crc_valid == false) {
+            uint8_t *bytes = data(c, false);
+            if (bytes == NULL)
+                return false;
+            c->crc = crc32c(0, bytes, c->cap);
+            c->crc_valid = true;
+        }
+        res = c->crc;
+        return true;
+    }
+
+    // Включаем фоновую проверку: каждый кусок в памяти проверяется примерно раз в period секунд
+    void enable_scrub(time_t period) {
+        scrubber = new Scrubber();
+        scrub_period = max(period, (time_t) 1);
+        scrub_last = time(NULL);
+    }
+
+    // Разбираем проверенные куски: сумма, которую ещё не считали, запоминается, а посчитанная ранее - сверяется.
+    // Пока кусок проверялся, на него была лишняя ссылка, поэтому писать в него не могли (запись сделала бы копию)
+    void reap_scrub() {
+        for (scrub_job *job: scrubber->take_done()) {
+            chunk *c = (chunk *) job->owner;
+            c->pins -= 1;
+            if (c->crc_valid == false) {
+                c->crc = job->crc;
+                c->crc_valid = true;
+                scrub_sealed += 1;
+            } else if (c->crc != job->crc && c->corrupt == false) {
+                c->corrupt = true;
+                scrub_errors += 1;
+                fprintf(stderr, "tmpfs: CRC32C куска данных не совпадает с сохранённой - память повреждена\n");
+            }
+            scrub_bytes += job->len;
+            scrub_jobs -= 1;
+            delete job;
+            put(c);  // файл мог удалить кусок, пока его проверяли
+        }
+    }
+
+    // Шаг фоновой проверки (в конце операций, см. balance): когда поток проверки закончил прошлую порцию,
+    // выдаём ему следующую - столько байт, чтобы за scrub_period секунд пройти все куски в памяти
+    void scrub() {
+        if (scrubber == NULL)
+            return;
+        reap_scrub();
+        time_t now = time(NULL);
+        if (scrub_jobs > 0 || now <= scrub_last)
+            return;
+
+        size_t budget = min((size_t) ((double) resident * (now - scrub_last) / scrub_period) + 1, SCRUB_MAX_BATCH);
+        scrub_last = now;
+        vector <scrub_job*> batch;
+        bool wrapped = false;
+        while (budget > 0) {
+            if (scrub_cursor == &lru) {  // дошли до самых свежих кусков - проход закончен
+                if (wrapped)
+                    break;  // за этот шаг обошли все куски
+                wrapped = true;
+                scrub_pass += 1;
+                scrub_cursor = lru.lru_prev;
+                continue;
+            }
+            chunk *c = scrub_cursor;
+            scrub_cursor = c->lru_prev;
+            if (c->scrub_pass == scrub_pass || c->state != CHUNK_RESIDENT || c->job != NULL || c->pins > 0)
+                continue;  // уже проверен в этом проходе (кусок мог переехать в начало списка) или занят вытеснением
+
+            c->scrub_pass = scrub_pass;
+            c->pins += 1;
+            c->refs += 1;
+            scrub_job *job = new scrub_job();
+            job->owner = c;
+            job->bytes = c->bytes;
+            job->len = c->cap;
+            batch.push_back(job);
+            budget -= min(budget, c->cap);
+        }
+        scrub_jobs += batch.size();
+        scrubber->submit(batch);
+    }
+
+    // Разбираем завершённые записи в файл вытеснения
+    void reap_jobs() {
+        for (spill_job *job: spill->take_done()) {
+            chunk *c = (chunk *) job->owner;
+            in_flight -= job->len;
+
+            if (c != NULL && c->state == CHUNK_WRITING && job->ok && c->pins == 0) {  // кусок за время записи не меняли и его никто не читает - отпускаем его память
+                c->job = NULL;
+                c->state = CHUNK_SPILLED;
+                c->slot = job->slot;
+                c->bytes = NULL;
+                spilled += c->cap;
+                spill_outs += 1;
+                lru_remove(c);
+                free_buffer(job->bytes, job->len);
+            } else {  // кусок удалён, изменён, занят фоновым заданием или запись не удалась - копия в файле не нужна
+                if (c != NULL) {
+                    c->job = NULL;
+                    c->state = CHUNK_RESIDENT;
+                }
+                if (c == NULL || c->bytes != job->bytes)
+                    free_buffer(job->bytes, job->len);
+                spill->free_slot(job->slot);
+            }
+            delete job;
+        }
+    }
+
+    // Следим за лимитом: самые старые куски отправляем в файл вытеснения. Вызывается в конце операций над файлом,
+    // а не посреди них, поэтому байты, полученные через data() внутри операции, не могут исчезнуть
+    void balance() {
+        scrub();
+        if (spill == NULL) {
+            reclaim();
+            return;
+        }
+        reap_jobs();
+
+        chunk *c = lru.lru_prev;
+        while (resident - in_flight > limit && c != &lru) {
+            chunk *prev = c->lru_prev;
+            if (c->state == CHUNK_RESIDENT && c->job == NULL && c->pins == 0) {  // буфер, который читает фоновое задание, не трогаем
+                if (c->slot != NO_SLOT) {  // в файле уже лежит актуальная копия - просто отпускаем память
+                    free_buffer(c->bytes, c->cap);
+                    c->bytes = NULL;
+                    c->state = CHUNK_SPILLED;
+                    spilled += c->cap;
+                    spill_outs += 1;
+                    lru_remove(c);
+                } else {
+                    spill_job *job = new spill_job();
+                    job->owner = c;
+                    job->bytes = c->bytes;
+                    job->len = c->cap;
+                    job->slot = spill->alloc_slot();
+                    job->ok = false;
+                    c->job = job;
+                    c->state = CHUNK_WRITING;
+                    in_flight += c->cap;
+                    spill->submit(job);
+                }
+            }
+            c = prev;
+        }
+        reclaim();
+    }
+
+    // Статистика для пользователя (см. атрибут user.tmpfs.spill)
+    string stats() {
+        if (spill != NULL)
+            reap_jobs();
+        return "resident_bytes=" + to_string(resident) +
+               " spilled_bytes=" + to_string(spilled) +
+               " writing_bytes=" + to_string(in_flight) +
+               " limit_bytes=" + to_string(limit) +
+               " spill_outs=" + to_string(spill_outs) +
+               " spill_ins=" + to_string(spill_ins) +
+               " spill_errors=" + to_string(spill_errors) +
+               " reclaim_pending_bytes=" + to_string(pool.pending_size()) +
+               " pool_free_bytes=" + to_string(pool.free_big_count() * POOL_BUFFER_SIZE) +
+               " pool_shards=" + to_string(pool.shards.size()) + "\n";
+    }
+
+    // Статистика фоновой проверки (см. атрибут user.tmpfs.scrub)
+    string scrub_stats() {
+        if (scrubber != NULL)
+            reap_scrub();
+        return "period=" + to_string(scrub_period) +
+               " passes=" + to_string(scrub_pass > 0 ? scrub_pass - 1 : 0) +
+               " checked_bytes=" + to_string(scrub_bytes) +
+               " sealed=" + to_string(scrub_sealed) +
+               " errors=" + to_string(scrub_errors) + "\n";
+    }
+
+    ~ChunkStore() {
+        if (scrubber != NULL) {
+            scrubber->shutdown();  // дожидаемся выданных заданий и отпускаем проверенные куски
+            reap_scrub();
+            delete scrubber;
+        }
+        if (spill != NULL) {
+            spill->shutdown();  // дожидаемся потока записи и освобождаем буферы оставшихся заданий
+            reap_jobs();
+            delete spill;
+        }
+        reclaim();  // пул дождётся, пока поток очистки всё разберёт
+    }
+};
@@ -1,9 +1,12 @@
 #pragma once
 
 #include <string>
+#include <string_view>
 #include <sys/stat.h>
 #include <vector>
+#include <algorithm>
 #include <string.h>
+#include <stdlib.h>
 
 #include "rasserts.hpp"
 
@@ -20,9 +23,7 @@ static struct timespec get_curr_timespec() {
 
 // Получаем путь вида /... - в конце без '/' и начинающийся со '/' - те путь от корня ФС:
 static string construct_path(const char *path) {
-    string s = "";
-    for (int i = 0; i < (int) strlen(path); i ++)
-        s += path[i];
+    string s = path;
     if (s == "/" || s == "")
         return s;
     if (s[0] != '/')
@@ -33,22 +34,26 @@ static string construct_path(const char *path) {
 }
 
 
-// Разбиваем строку str на куски по разделителю del:
-static vector <string> str_split(string str, string del, bool ignore_empty=true) {
-    size_t pos = 0;  // позиция, где разделитель
-    vector <string> tokens;
+// Разбиваем путь на компоненты по '/' без копирования (пустые компоненты - от повторных и концевых '/' - пропускаем):
+//     path_tokens tokens(path); string_view token; while (tokens.next(token)) ...
+struct path_tokens {
+    string_view rest;  // ещё не разобранная часть пути
 
-    while (1) {
-        pos = str.find(del);
-        string cur_token = str.substr(0, pos);  // взяли текущей токен
-        if (cur_token.size() > 0 || ignore_empty == 0)  // добавляем с вектор, если он не пустой или если мы НЕ игнорируем пустые токены
-            tokens.push_back(cur_token);
-        if (pos == string::npos)  // если так, то разделитель НЕ находится в строке
-            break;
-        str.erase(0, pos + del.length());  // спокойно меняем str, так как ф функцию передаётся её копия
+    path_tokens(const char *path) {
+        rest = path;
     }
-    return tokens;
-}
+
+    bool next(string_view &token) {
+        while (rest.size() > 0 && rest[0] == '/')
+            rest.remove_prefix(1);
+        if (rest.size() == 0)
+            return false;
+        size_t pos = min(rest.find('/'), rest.size());
+        token = rest.substr(0, pos);
+        rest.remove_prefix(pos);
+        return true;
+    }
+};
 
 
 // Функция из пути достаёт префикс и кончик - имя файла или директории, на которую path ведёт
@@ -63,6 +68,26 @@ static void get_prefix_and_name(const char *_path, string &prefix, string &name)
 }
 
 
+// Разбираем размер вида "4096", "512K", "64M", "2G" (в байтах); при ошибке возвращаем false:
+static bool parse_size(const char *str, size_t &res) {
+    char *end;
+    unsigned long long val = strtoull(str, &end, 10);
+    if (end == str)
+        return false;
+    switch (*end) {
+        case 'G': case 'g': val *= 1024;  // fall through
+        case 'M': case 'm': val *= 1024;  // fall through
+        case 'K': case 'k': val *= 1024; end += 1; break;
+        case 0: break;
+        default: return false;
+    }
+    if (*end != 0)
+        return false;
+    res = (size_t) val;
+    return true;
+}
+
+
 // Проферяем корректность времени:
 static bool check_tv(struct timespec tv) {
     if (tv.tv_nsec == UTIME_NOW || tv.tv_nsec == UTIME_OMIT)
@@ -0,0 +1,260 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <vector>
+#include <algorithm>
+
+#include "rasserts.hpp"
+#include "chunk_store.hpp"
+
+using namespace std;
+
+
+// === Структура данных файла ===
+// Данные хранятся кусками по CHUNK_SIZE байт; кусок NULL - "дыра", она читается как нули и не занимает памяти.
+// Буфер куска может быть короче CHUNK_SIZE (см. chunk_cap) - байты за его концом тоже читаются как нули.
+// Инвариант: байты последнего куска, лежащие за концом файла (за size), всегда нулевые.
+// Байты куска берём только через store->data(): кусок мог быть вытеснен в файл (см. chunk_store.hpp)
+struct file_data {
+    vector <chunk*> chunks;  // куски данных: i-ый кусок хранит байты [i * CHUNK_SIZE, (i + 1) * CHUNK_SIZE)
+    size_t size;  // количество байт данных
+    ChunkStore *store;  // откуда берём куски
+
+    file_data(ChunkStore *_store) {
+        size = 0;
+        store = _store;
+    }
+
+    ~file_data() {
+        for (chunk *c: chunks)
+            store->put(c);
+        store->reclaim();  // сами буферы освободит поток очистки
+    }
+
+    // Получаем i-ый кусок, в первые need байт которого можно писать: дыру заменяем на новый нулевой кусок,
+    // разделяемый кусок - копируем, слишком короткий буфер - увеличиваем. NULL - вытесненный кусок не удалось прочитать
+    uint8_t *writable_chunk(size_t i, size_t need) {
+        chunk *c = chunks[i];
+        if (c == NULL) {
+            c = store->alloc(chunk_cap(need), true);
+        } else if (c->refs > 1) {
+            uint8_t *bytes = store->data(c, false);
+            if (bytes == NULL)
+                return NULL;
+            chunk *copy = store->alloc(max(c->cap, chunk_cap(need)), true);
+            memcpy(copy->bytes, bytes, c->cap);
+            store->put(c);
+            c = copy;
+        }
+        chunks[i] = c;
+        if (store->data(c, true) == NULL)
+            return NULL;
+        return store->grow(c, need);
+    }
+
+    // Копируем part байт i-го куска со смещения in в buf: дыры и байты за концом буфера куска - нули.
+    // false - вытесненный кусок не удалось прочитать
+    bool read_chunk(char *buf, size_t i, size_t in, size_t part) {
+        chunk *c = chunks[i];
+        size_t have = (c != NULL && c->cap > in) ? min(part, c->cap - in) : 0;
+        if (have > 0) {
+            uint8_t *bytes = store->data(c, false);
+            if (bytes == NULL)
+                return false;
+            memmove(buf, bytes + in, have);
+        }
+        memset(buf + have, 0, part - have);
+        return true;
+    }
+
+    // Забираем готовые буферы (см. import.hpp) как содержимое пустого файла - без копирования.
+    // Все буферы, кроме последнего, по CHUNK_SIZE байт, последний - chunk_cap(сколько в нём данных)
+    void adopt(const vector <uint8_t*> &bufs, size_t newsize) {
+        size_t n = (newsize + CHUNK_SIZE - 1) / CHUNK_SIZE;
+        rassert(size == 0 && bufs.size() == n, "Некорректное содержимое импортируемого файла!");
+        for (size_t i = 0; i < n; i ++)
+            chunks.push_back(store->adopt(bufs[i], i + 1 < n ? CHUNK_SIZE : chunk_cap(newsize - i * CHUNK_SIZE)));
+        size = newsize;
+        store->balance();
+    }
+
+    // Заменяем содержимое первыми newsize байтами файла fd (режим кэша над нижней директорией, см. tmpfs.cpp);
+    // нулевые куски остаются дырами, байты за концом fd (если он оказался короче) - нули. false - ошибка чтения (в errno), файл пуст
+    bool load(int fd, size_t newsize) {
+        resize(0);
+        resize(newsize);
+        for (size_t i = 0; i < chunks.size(); i ++) {
+            size_t len = min(CHUNK_SIZE, newsize - i * CHUNK_SIZE);
+            chunk *c = store->alloc(chunk_cap(len), false);
+            size_t done = 0;
+            while (done < len) {
+                ssize_t res = pread(fd, c->bytes + done, len - done, i * CHUNK_SIZE + done);
+                if (res < 0 && errno == EINTR)
+                    continue;
+                if (res < 0) {
+                    int err = errno;
+                    store->put(c);
+                    resize(0);
+                    errno = err;
+                    return false;
+                }
+                if (res == 0)
+                    break;
+                done += res;
+            }
+            memset(c->bytes + done, 0, c->cap - done);
+
+            bool zero = true;
+            for (size_t k = 0; k < done && zero; k ++)
+                zero = c->bytes[k] == 0;
+            if (zero)
+                store->put(c);
+            else
+                chunks[i] = c;
+            store->balance();  // большой файл может не поместиться в лимит памяти целиком
+        }
+        return true;
+    }
+
+    // Меняем размер файла; при уменьшении хвост последнего куска зануляем, чтобы сохранить инвариант.
+    // false - этот кусок не удалось прочитать из файла вытеснения, размер не изменился (увеличение всегда успешно)
+    bool resize(size_t newsize) {
+        size_t n = (newsize + CHUNK_SIZE - 1) / CHUNK_SIZE;  // сколько кусков нужно под newsize байт
+        size_t tail = newsize % CHUNK_SIZE;
+        if (newsize < size && tail != 0 && chunks[n-1] != NULL && chunks[n-1]->cap > tail) {
+            uint8_t *bytes = writable_chunk(n-1, 0);
+            if (bytes == NULL) {
+                store->balance();
+                return false;
+            }
+            memset(bytes + tail, 0, chunks[n-1]->cap - tail);
+        }
+
+        for (size_t i = n; i < chunks.size(); i ++)
+            store->put(chunks[i]);
+        chunks.resize(n, NULL);  // новые куски - дыры
+        size = newsize;
+        store->balance();
+        return true;
+    }
+
+    // Читаем не более len байт начиная со смещения offset в buf, возвращаем количество прочитанных байт
+    // (-EIO - кусок не удалось прочитать из файла вытеснения)
+    ssize_t read(char *buf, size_t len, size_t offset) {
+        if (offset >= size)
+            return 0;
+        len = min(len, size - offset);
+
+        size_t done = 0;
+        while (done < len) {
+            size_t pos = offset + done;
+            size_t part = min(len - done, CHUNK_SIZE - pos % CHUNK_SIZE);  // читаем до конца текущего куска
+            if (read_chunk(buf + done, pos / CHUNK_SIZE, pos % CHUNK_SIZE, part) == false)
+                break;
+            done += part;
+        }
+        store->balance();
+        return done < len ? -EIO : (ssize_t) len;
+    }
+
+    // Пишем len байт из buf начиная со смещения offset (если offset за концом файла - промежуток станет дырой);
+    // -EIO - кусок, в который пишем, не удалось прочитать из файла вытеснения (часть байт уже могла записаться)
+    ssize_t write(const char *buf, size_t len, size_t offset) {
+        if (offset + len > size)
+            resize(offset + len);
+
+        size_t done = 0;
+        while (done < len) {
+            size_t pos = offset + done;
+            size_t part = min(len - done, CHUNK_SIZE - pos % CHUNK_SIZE);
+            uint8_t *bytes = writable_chunk(pos / CHUNK_SIZE, pos % CHUNK_SIZE + part);
+            if (bytes == NULL)
+                break;
+            memcpy(bytes + pos % CHUNK_SIZE, buf + done, part);
+            done += part;
+        }
+        store->balance();
+        return done < len ? -EIO : (ssize_t) len;
+    }
+
+    // CRC32C всего содержимого файла: собираем из сумм кусков, пересчитывая только куски, изменённые после прошлого раза;
+    // дыры и нулевые хвосты буферов учитываем без чтения. false - в одном из кусков найдено повреждение памяти
+    // или его не удалось прочитать из файла вытеснения
+    bool checksum(uint32_t &res) {
+        static const uint32_t chunk_shift = crc32c_shift(CHUNK_SIZE);
+        uint32_t crc = 0;
+        for (size_t i = 0; i < chunks.size(); i ++) {
+            chunk *c = chunks[i];
+            size_t len = min(CHUNK_SIZE, size - i * CHUNK_SIZE);  // последний кусок файла может быть неполным
+            uint32_t part;
+            if (c == NULL) {
+                part = crc32c_zeros(len);
+            } else if (c->corrupt) {
+                store->balance();
+                return false;
+            } else if (len >= c->cap) {
+                uint32_t sum;
+                if (store->checksum(c, sum) == false) {
+                    store->balance();
+                    return false;
+                }
+                part = crc32c_combine(sum, crc32c_zeros(len - c->cap), len - c->cap);
+            } else {
+                uint8_t *bytes = store->data(c, false);
+                if (bytes == NULL) {
+                    store->balance();
+                    return false;
+                }
+                part = crc32c(0, bytes, len);  // сумма буфера захватывает нули за концом файла
+            }
+            crc = len == CHUNK_SIZE ? crc32c_combine_shifted(crc, part, chunk_shift) : crc32c_combine(crc, part, len);
+        }
+        store->balance();
+        res = crc;
+        return true;
+    }
+
+    // Копируем len байт файла src со смещения src_off в себя по смещению dst_off, не выходя через буфер пользователя;
+    // куски, которые целиком копируются по выровненным на CHUNK_SIZE смещениям, не копируются, а разделяются (copy-on-write);
+    // -EIO - кусок не удалось прочитать из файла вытеснения
+    ssize_t copy_range(file_data *src, size_t src_off, size_t dst_off, size_t len) {
+        if (src_off >= src->size || len == 0)
+            return 0;
+        len = min(len, src->size - src_off);
+
+        if (src == this && src_off < dst_off + len && dst_off < src_off + len && src_off != dst_off) {
+            vector <char> tmp(len);  // диапазоны внутри одного файла пересекаются - копируем через временный буфер
+            ssize_t res = read(tmp.data(), len, src_off);
+            return res < 0 ? res : write(tmp.data(), len, dst_off);
+        }
+
+        if (dst_off + len > size)
+            resize(dst_off + len);
+
+        size_t done = 0;
+        while (done < len) {
+            size_t s = src_off + done, d = dst_off + done;
+
+            if (s % CHUNK_SIZE == 0 && d % CHUNK_SIZE == 0 && len - done >= CHUNK_SIZE) {  // целый выровненный кусок - просто ссылаемся на него
+                chunk *c = src->chunks[s / CHUNK_SIZE];
+                if (c != NULL)
+                    c->refs += 1;  // сначала берём ссылку: кусок может совпадать с тем, который сейчас отпустим
+                store->put(chunks[d / CHUNK_SIZE]);
+                chunks[d / CHUNK_SIZE] = c;
+                done += CHUNK_SIZE;
+                continue;
+            }
+
+            size_t part = min(len - done, min(CHUNK_SIZE - s % CHUNK_SIZE, CHUNK_SIZE - d % CHUNK_SIZE));  // до ближайшей границы куска
+            uint8_t *dst_bytes = writable_chunk(d / CHUNK_SIZE, d % CHUNK_SIZE + part);
+            if (dst_bytes == NULL || src->read_chunk((char *) dst_bytes + d % CHUNK_SIZE, s / CHUNK_SIZE, s % CHUNK_SIZE, part) == false)
+                break;  // после writable_chunk: если src == this, кусок мог быть скопирован
+            done += part;
+        }
+        store->balance();
+        return done < len ? -EIO : (ssize_t) len;
+    }
+};
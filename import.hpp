@@ -0,0 +1,502 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include <vector>
+#include <deque>
+#include <string>
+#include <map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "chunk_store.hpp"
+
+using namespace std;
+
+
+#define IMPORT_MAX_CHUNKS 4096  // сколько прочитанных, но ещё не разобранных кусков может висеть в очереди (4096 * 64 КБ = 256 МБ)
+#define IMPORT_MAX_ENTRIES 65536  // сколько записей может висеть в очереди
+
+#define IMPORT_DIR 'd'  // директория
+#define IMPORT_FILE 'f'  // файл; содержимое либо лежит в записи, либо придёт позже отдельной записью IMPORT_CONTENT
+#define IMPORT_HARDLINK 'h'  // жёсткая ссылка на уже импортированный файл link
+#define IMPORT_CONTENT 'c'  // содержимое файла, созданного раньше записью с тем же id
+
+
+
+// === Одна запись импорта: что нужно создать в ФС ===
+struct import_entry {
+    char type;
+    string path;  // путь относительно корня ФС
+    string link;  // для жёсткой ссылки - путь к файлу, на который она ссылается
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+    struct timespec atim, mtim;
+    size_t id;  // связывает файл с его содержимым, которое придёт позже (0 - содержимое уже в записи)
+    size_t size;  // размер файла
+    vector <uint8_t*> bufs;  // содержимое: буферы пула по CHUNK_SIZE байт, последний - chunk_cap байт (хвост - нули); их заберёт file_data::adopt
+
+    import_entry() {
+        type = 0;
+        mode = 0;
+        uid = 0;
+        gid = 0;
+        atim = mtim = {0, 0};
+        id = 0;
+        size = 0;
+    }
+};
+
+
+
+// === Очередь записей импорта: несколько потоков кладут, поток, строящий ФС, забирает ===
+// Очередь ограничена, поэтому, если дерево в памяти строится медленнее, чем читаются данные, читатели ждут.
+struct ImportQueue {
+    mutex m;
+    condition_variable cv;
+    deque <import_entry*> entries;
+    size_t chunks;  // сколько буферов лежит в очереди
+    int producers;  // сколько потоков ещё могут что-то положить
+    BufferPool *pool;  // откуда берём буферы для содержимого
+
+    ImportQueue(BufferPool *_pool) {
+        chunks = 0;
+        producers = 0;
+        pool = _pool;
+    }
+
+    void push(import_entry *entry) {
+        unique_lock <mutex> lock(m);
+        cv.wait(lock, [this] { return entries.size() < IMPORT_MAX_ENTRIES && (chunks < IMPORT_MAX_CHUNKS || entries.size() == 0); });
+        chunks += entry->bufs.size();
+        entries.push_back(entry);
+        cv.notify_all();
+    }
+
+    void producer_done() {
+        lock_guard <mutex> lock(m);
+        producers -= 1;
+        cv.notify_all();
+    }
+
+    // Следующая запись или NULL, если записей больше не будет
+    import_entry *pop() {
+        unique_lock <mutex> lock(m);
+        cv.wait(lock, [this] { return entries.size() > 0 || producers == 0; });
+        if (entries.size() == 0)
+            return NULL;
+        import_entry *entry = entries.front();
+        entries.pop_front();
+        chunks -= entry->bufs.size();
+        cv.notify_all();
+        return entry;
+    }
+};
+
+
+// Читаем ровно len байт (меньше - только если поток закончился); возвращаем сколько прочитали
+static size_t read_full(int fd, void *buf, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t res = read(fd, (char *) buf + done, len - done);
+        if (res < 0 && errno == EINTR)
+            continue;
+        if (res <= 0)
+            break;
+        done += res;
+    }
+    return done;
+}
+
+
+// Читаем size байт из fd в буферы кусков: все по CHUNK_SIZE, последний - chunk_cap(сколько в нём данных);
+// возвращаем сколько удалось прочитать
+static size_t read_chunks(BufferPool *pool, int fd, size_t size, vector <uint8_t*> &bufs) {
+    size_t done = 0;
+    while (done < size) {
+        size_t part = min(size - done, CHUNK_SIZE);
+        size_t cap = chunk_cap(part);
+        uint8_t *buf = pool->alloc(cap);
+        size_t got = read_full(fd, buf, part);
+        if (got == 0) {  // файл оказался короче, чем мы думали
+            pool->release(buf, cap);
+            break;
+        }
+        if (chunk_cap(got) < cap) {  // короткий хвост - буфер должен соответствовать тому, что реально прочитали
+            uint8_t *small = pool->alloc(chunk_cap(got));
+            memcpy(small, buf, got);
+            pool->release(buf, cap);
+            buf = small;
+            cap = chunk_cap(got);
+        }
+        memset(buf + got, 0, cap - got);
+        bufs.push_back(buf);
+        done += got;
+        if (got < part)
+            break;
+    }
+    return done;
+}
+
+
+// Удаляем запись вместе с содержимым, которое так и не понадобилось
+static void drop_entry(BufferPool *pool, import_entry *entry) {
+    if (entry == NULL)
+        return;
+    vector <dead_buffer> dead;
+    for (size_t i = 0; i < entry->bufs.size(); i ++)
+        dead.push_back({entry->bufs[i], i + 1 < entry->bufs.size() ? CHUNK_SIZE : chunk_cap(entry->size - i * CHUNK_SIZE)});
+    pool->release(dead);
+    delete entry;
+}
+
+
+
+// === Импорт директории хоста: один поток обходит дерево, пул потоков читает содержимое файлов ===
+struct DirImporter {
+    struct job {
+        string host_path;
+        size_t id;
+        size_t size;
+    };
+
+    ImportQueue *queue;
+    string root;
+    mutex m;
+    condition_variable cv;
+    deque <job> jobs;
+    bool walked;  // обход закончен - новых заданий не будет
+    bool ok;  // все директории и файлы прочитаны целиком (пишется под m, читается после join)
+    size_t next_id;
+    map <pair <dev_t, ino_t>, string> seen;  // файлы с несколькими жёсткими ссылками: (устройство, inode) -> путь первой ссылки
+    vector <thread> threads;
+
+    DirImporter(ImportQueue *_queue, const string &_root) {
+        queue = _queue;
+        root = _root;
+        walked = false;
+        ok = true;
+        next_id = 1;
+    }
+
+    void start() {
+        size_t n_readers = max(thread::hardware_concurrency(), 2u);
+        queue->producers = n_readers + 1;
+        threads.push_back(thread(&DirImporter::walk_all, this));
+        for (size_t i = 0; i < n_readers; i ++)
+            threads.push_back(thread(&DirImporter::reader_loop, this));
+    }
+
+    void join() {
+        for (thread &t: threads)
+            t.join();
+    }
+
+    void fail(const string &host_path, const char *why=NULL) {  // что-то прочитать не удалось - импорт неполный; why=NULL - причина в errno
+        if (why != NULL)
+            fprintf(stderr, "%s: %s\n", host_path.c_str(), why);
+        else
+            perror(host_path.c_str());
+        lock_guard <mutex> lock(m);
+        ok = false;
+    }
+
+    static import_entry *meta_entry(char type, const string &path, const struct stat &st) {
+        import_entry *entry = new import_entry();
+        entry->type = type;
+        entry->path = path;
+        entry->mode = st.st_mode & 07777;
+        entry->uid = st.st_uid;
+        entry->gid = st.st_gid;
+        entry->atim = st.st_atim;
+        entry->mtim = st.st_mtim;
+        entry->size = st.st_size;
+        return entry;
+    }
+
+    void walk(const string &rel) {  // rel - путь относительно корня, "" - сам корень
+        string host_dir = root + "/" + rel;
+        DIR *dir = opendir(host_dir.c_str());
+        if (dir == NULL) {
+            fail(host_dir);
+            return;
+        }
+
+        struct dirent *de;
+        while ((de = readdir(dir)) != NULL) {
+            if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+                continue;
+            string path = rel.size() > 0 ? rel + "/" + de->d_name : string(de->d_name);
+            struct stat st;
+            if (fstatat(dirfd(dir), de->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+                fail(root + "/" + path);
+                continue;
+            }
+
+            if (S_ISDIR(st.st_mode)) {
+                queue->push(meta_entry(IMPORT_DIR, path, st));
+                walk(path);
+            } else if (S_ISREG(st.st_mode)) {
+                if (st.st_nlink > 1) {
+                    auto key = make_pair(st.st_dev, st.st_ino);
+                    if (seen.count(key) == 1) {
+                        import_entry *entry = meta_entry(IMPORT_HARDLINK, path, st);
+                        entry->link = seen[key];
+                        queue->push(entry);
+                        continue;
+                    }
+                    seen[key] = path;
+                }
+                import_entry *entry = meta_entry(IMPORT_FILE, path, st);
+                size_t id = next_id++;
+                entry->id = id;
+                queue->push(entry);  // запись о файле встаёт в очередь раньше его содержимого; после push запись уже не наша
+
+                lock_guard <mutex> lock(m);
+                jobs.push_back({root + "/" + path, id, (size_t) st.st_size});
+                cv.notify_one();
+            } else {
+                fprintf(stderr, "Импорт: пропускаем %s - поддерживаются только файлы и директории\n", path.c_str());
+            }
+        }
+        closedir(dir);
+    }
+
+    void walk_all() {
+        walk("");
+        {
+            lock_guard <mutex> lock(m);
+            walked = true;
+            cv.notify_all();
+        }
+        queue->producer_done();
+    }
+
+    void reader_loop() {
+        while (1) {
+            job j;
+            {
+                unique_lock <mutex> lock(m);
+                cv.wait(lock, [this] { return walked || jobs.size() > 0; });
+                if (jobs.size() == 0)
+                    break;
+                j = jobs.front();
+                jobs.pop_front();
+            }
+
+            import_entry *entry = new import_entry();
+            entry->type = IMPORT_CONTENT;
+            entry->id = j.id;
+            int fd = open(j.host_path.c_str(), O_RDONLY);
+            if (fd < 0) {
+                fail(j.host_path);
+            } else {
+                entry->size = read_chunks(queue->pool, fd, j.size, entry->bufs);
+                if (entry->size != j.size)
+                    fail(j.host_path, "прочитано меньше, чем размер файла при обходе (ошибка чтения или файл стал короче)");
+                close(fd);
+            }
+            queue->push(entry);  // содержимое (хоть и неполное) всё равно отдаём - его ждёт запись о файле
+        }
+        queue->producer_done();
+    }
+};
+
+
+
+// === Импорт tar-архива (ustar, а также длинные имена GNU и pax-заголовки) из файла или стандартного ввода ===
+// Поток разбора читает содержимое файлов сразу в буферы кусков, а дерево в это время строит другой поток.
+struct TarImporter {
+    ImportQueue *queue;
+    int fd;
+    bool ok;  // архив прочитан без ошибок
+    thread reader;
+
+    TarImporter(ImportQueue *_queue, int _fd) {
+        queue = _queue;
+        fd = _fd;
+        ok = true;
+    }
+
+    void start() {
+        queue->producers = 1;
+        reader = thread(&TarImporter::parse, this);
+    }
+
+    void join() {
+        reader.join();
+    }
+
+    // Число из заголовка: восьмеричное в ASCII или двоичное (big-endian), если старший бит первого байта выставлен
+    static uint64_t tar_number(const char *field, size_t len) {
+        uint64_t res = 0;
+        if ((uint8_t) field[0] & 0x80) {
+            for (size_t i = 1; i < len; i ++)
+                res = (res << 8) | (uint8_t) field[i];
+            return res;
+        }
+        for (size_t i = 0; i < len && field[i] != 0; i ++) {
+            if (field[i] >= '0' && field[i] <= '7')
+                res = res * 8 + (field[i] - '0');
+        }
+        return res;
+    }
+
+    // Контрольная сумма заголовка (смещение 148): сумма всех 512 байт, где само поле считается пробелами.
+    // Старые архиваторы суммировали байты со знаком - такую сумму тоже принимаем.
+    static bool tar_checksum_ok(const char *header) {
+        uint64_t expected = tar_number(header + 148, 8);
+        uint64_t sum = 0;
+        int64_t signed_sum = 0;
+        for (size_t i = 0; i < 512; i ++) {
+            char c = (i >= 148 && i < 156) ? ' ' : header[i];
+            sum += (uint8_t) c;
+            signed_sum += (signed char) c;
+        }
+        return expected == sum || (int64_t) expected == signed_sum;
+    }
+
+    static string tar_string(const char *field, size_t len) {
+        return string(field, strnlen(field, len));
+    }
+
+    bool skip(size_t len) {
+        char buf[4096];
+        while (len > 0) {
+            size_t part = min(len, sizeof(buf));
+            if (read_full(fd, buf, part) != part)
+                return false;
+            len -= part;
+        }
+        return true;
+    }
+
+    bool read_string(size_t len, string &res) {  // содержимое служебной записи (длинное имя, pax-заголовок)
+        res.resize(len);
+        if (read_full(fd, &res[0], len) != len)
+            return false;
+        return skip((512 - len % 512) % 512);
+    }
+
+    // Разбираем pax-заголовок: записи вида "длина ключ=значение\n"
+    static void parse_pax(const string &pax, map <string, string> &attrs) {
+        size_t pos = 0;
+        while (pos < pax.size()) {
+            size_t len = strtoul(pax.c_str() + pos, NULL, 10);
+            size_t space = pax.find(' ', pos);
+            if (len == 0 || space == string::npos || pos + len > pax.size())
+                break;
+            string record = pax.substr(space + 1, pos + len - space - 2);  // без завершающего '\n'
+            size_t eq = record.find('=');
+            if (eq != string::npos)
+                attrs[record.substr(0, eq)] = record.substr(eq + 1);
+            pos += len;
+        }
+    }
+
+    void parse() {
+        char header[512];
+        string long_name, long_link;
+        map <string, string> pax;
+
+        while (1) {
+            if (read_full(fd, header, 512) != 512) {
+                ok = false;  // архив оборвался, так и не дойдя до нулевого блока
+                break;
+            }
+            if (header[0] == 0)
+                break;  // нулевой блок - конец архива
+            if (tar_checksum_ok(header) == false) {
+                fprintf(stderr, "Импорт: неверная контрольная сумма заголовка - архив повреждён или это не tar\n");
+                ok = false;
+                break;
+            }
+
+            char type = header[156];
+            uint64_t size = tar_number(header + 124, 12);
+            if (pax.count("size") == 1)
+                size = strtoull(pax["size"].c_str(), NULL, 10);
+
+            if (type == 'L' || type == 'K' || type == 'x') {  // служебные записи относятся к следующей записи
+                string data;
+                if (read_string(size, data) == false) {
+                    ok = false;
+                    break;
+                }
+                if (type == 'L')
+                    long_name = data.c_str();
+                else if (type == 'K')
+                    long_link = data.c_str();
+                else
+                    parse_pax(data, pax);
+                continue;
+            }
+
+            import_entry *entry = new import_entry();
+            entry->path = tar_string(header, 100);
+            if (memcmp(header + 257, "ustar", 6) == 0 && header[345] != 0)  // префикс пути есть только в POSIX ustar ("ustar\0"), у GNU ("ustar  ") там другие поля
+                entry->path = tar_string(header + 345, 155) + "/" + entry->path;
+            if (long_name.size() > 0)
+                entry->path = long_name;
+            if (pax.count("path") == 1)
+                entry->path = pax["path"];
+            entry->link = long_link.size() > 0 ? long_link : tar_string(header + 157, 100);
+            if (pax.count("linkpath") == 1)
+                entry->link = pax["linkpath"];
+            entry->mode = tar_number(header + 100, 8) & 07777;
+            entry->uid = pax.count("uid") == 1 ? strtoul(pax["uid"].c_str(), NULL, 10) : tar_number(header + 108, 8);
+            entry->gid = pax.count("gid") == 1 ? strtoul(pax["gid"].c_str(), NULL, 10) : tar_number(header + 116, 8);
+            entry->mtim.tv_sec = pax.count("mtime") == 1 ? strtoll(pax["mtime"].c_str(), NULL, 10) : tar_number(header + 136, 12);
+            entry->atim = entry->mtim;
+            if (pax.count("atime") == 1)
+                entry->atim.tv_sec = strtoll(pax["atime"].c_str(), NULL, 10);
+            long_name.clear();
+            long_link.clear();
+            pax.clear();
+
+            bool has_data = false;
+            if (type == '0' || type == 0 || type == '7') {
+                entry->type = IMPORT_FILE;
+                entry->size = read_chunks(queue->pool, fd, size, entry->bufs);
+                if (entry->size != size) {
+                    ok = false;
+                    queue->push(entry);
+                    break;
+                }
+                has_data = true;
+            } else if (type == '5') {
+                entry->type = IMPORT_DIR;
+            } else if (type == '1') {
+                entry->type = IMPORT_HARDLINK;
+            } else {
+                fprintf(stderr, "Импорт: пропускаем %s - поддерживаются только файлы, директории и жёсткие ссылки\n", entry->path.c_str());
+                delete entry;
+                entry = NULL;
+            }
+
+            if (has_data == false && skip(size) == false) {  // данные записей, которые не храним, пропускаем
+                ok = false;
+                drop_entry(queue->pool, entry);
+                break;
+            }
+            if (skip((512 - size % 512) % 512) == false) {  // данные дополнены нулями до границы блока
+                ok = false;
+                drop_entry(queue->pool, entry);
+                break;
+            }
+            if (entry != NULL)
+                queue->push(entry);
+        }
+        queue->producer_done();
+    }
+};
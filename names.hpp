@@ -0,0 +1,223 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <fnmatch.h>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <unordered_map>
+#include <set>
+#include <algorithm>
+
+#include "rasserts.hpp"
+
+using namespace std;
+
+
+#define NAME_BLOCK_SIZE ((size_t) 64 * 1024)  // имена складываются в блоки такого размера
+
+typedef uint32_t name_id;  // номер имени в NameArena
+#define NO_NAME ((name_id) -1)  // такого имени в NameArena нет
+
+#define FIND_PATH "/.find"  // виртуальная директория поиска по индексу имён: ls FIND_PATH/'шаблон'
+
+
+
+// === Хранилище имён файлов: каждое различное имя лежит в памяти один раз ===
+// Директории хранят не строки, а номера имён; одинаковые имена (Makefile, index.js, ...) во всех директориях - это один номер.
+// Имена лежат подряд в больших блоках (с завершающим нулём - их можно сразу отдавать в readdir). На имя есть счётчик ссылок:
+// неиспользуемое имя удаляется из индекса, а место под него собирается, когда мёртвых байт становится больше живых.
+// Указатели, полученные через str()/view(), действительны до следующего вызова intern.
+struct NameArena {
+    struct name {
+        const char *str;
+        uint32_t len;
+        uint32_t refs;  // сколько записей в директориях ссылаются на имя (0 - номер свободен)
+    };
+
+    vector <char*> blocks;
+    size_t block_used;  // сколько байт занято в последнем блоке
+    vector <name> names;  // номер имени -> имя
+    vector <name_id> free_ids;
+    unordered_map <string_view, name_id> index;  // имя -> номер; ключи указывают в блоки
+    size_t live_bytes, dead_bytes;
+
+    NameArena() {
+        block_used = NAME_BLOCK_SIZE;  // блоков ещё нет - первый выделится при первом имени
+        live_bytes = dead_bytes = 0;
+    }
+
+    // Номер имени s или NO_NAME, если такого имени нет ни в одной директории; память не выделяет
+    name_id find(string_view s) {
+        auto it = index.find(s);
+        return it == index.end() ? NO_NAME : it->second;
+    }
+
+    const char *str(name_id id) {
+        return names[id].str;
+    }
+
+    string_view view(name_id id) {
+        return string_view(names[id].str, names[id].len);
+    }
+
+    // Берём ссылку на имя s (если его ещё нет - копируем в блоки); s не должно указывать в сами блоки
+    name_id intern(string_view s) {
+        name_id id = find(s);
+        if (id != NO_NAME) {
+            names[id].refs += 1;
+            return id;
+        }
+
+        if (dead_bytes > live_bytes && dead_bytes > NAME_BLOCK_SIZE)
+            compact();
+        const char *str = store(s);
+        if (free_ids.size() > 0) {
+            id = free_ids.back();
+            free_ids.pop_back();
+        } else {
+            rassert(names.size() < NO_NAME, "Слишком много различных имён!");
+            id = names.size();
+            names.push_back({NULL, 0, 0});
+        }
+        names[id] = {str, (uint32_t) s.size(), 1};
+        index.insert({string_view(str, s.size()), id});
+        live_bytes += s.size() + 1;
+        return id;
+    }
+
+    // Отпускаем ссылку на имя
+    void release(name_id id) {
+        rassert(names[id].refs > 0, "Отпускаем имя, на которое никто не ссылается!");
+        names[id].refs -= 1;
+        if (names[id].refs > 0)
+            return;
+        index.erase(view(id));
+        live_bytes -= names[id].len + 1;
+        dead_bytes += names[id].len + 1;
+        names[id].str = NULL;
+        free_ids.push_back(id);
+    }
+
+    // Кладём копию s (с нулём в конце) в блоки
+    const char *store(string_view s) {
+        size_t need = s.size() + 1;
+        if (block_used + need > NAME_BLOCK_SIZE) {  // длинное имя получает собственный блок
+            blocks.push_back(new char[max(need, NAME_BLOCK_SIZE)]);
+            block_used = 0;
+        }
+        char *str = blocks.back() + block_used;
+        memcpy(str, s.data(), s.size());
+        str[s.size()] = 0;
+        block_used += need;
+        return str;
+    }
+
+    // Переносим живые имена в новые блоки и освобождаем старые (номера имён не меняются)
+    void compact() {
+        vector <char*> old_blocks;
+        old_blocks.swap(blocks);
+        block_used = NAME_BLOCK_SIZE;
+        index.clear();
+        for (name_id id = 0; id < names.size(); id ++) {
+            if (names[id].refs == 0)
+                continue;
+            names[id].str = store(view(id));
+            index.insert({view(id), id});
+        }
+        for (char *block: old_blocks)
+            delete[] block;
+        dead_bytes = 0;
+    }
+
+    ~NameArena() {
+        for (char *block: blocks)
+            delete[] block;
+    }
+};
+
+
+// Одно хранилище имён на всю ФС
+static NameArena &name_arena() {
+    static NameArena arena;
+    return arena;
+}
+
+
+
+// === Запись индекса имён: в директории dir есть запись с именем name ===
+struct name_entry {
+    name_id name;
+    int dir;  // номер inode директории
+};
+
+
+
+// === Глобальный индекс имён: все записи всех директорий, упорядоченные по имени ===
+// Нужен, чтобы искать файлы по имени или шаблону (как find -name), не обходя дерево: записи с общим
+// префиксом идут подряд, поэтому шаблон с постоянным началом ('libfoo*.so') просматривает только свой диапазон.
+// Записи "." и ".." не хранятся. Включается до появления первых имён; выключенный индекс ничего не стоит.
+struct NameIndex {
+    struct by_name {  // сравниваем записи по строке имени (номера имён не упорядочены), затем по директории
+        typedef void is_transparent;  // можно искать и по string_view - по началу имени
+        bool operator () (const name_entry &a, const name_entry &b) const {
+            int cmp = name_arena().view(a.name).compare(name_arena().view(b.name));
+            return cmp != 0 ? cmp < 0 : a.dir < b.dir;
+        }
+        bool operator () (const name_entry &a, string_view b) const {
+            return name_arena().view(a.name) < b;
+        }
+        bool operator () (string_view a, const name_entry &b) const {
+            return a < name_arena().view(b.name);
+        }
+    };
+
+    bool enabled;
+    set <name_entry, by_name> entries;
+
+    NameIndex() {
+        enabled = false;
+    }
+
+    static bool is_dot(string_view name) {
+        return name == "." || name == "..";
+    }
+
+    void add(name_id name, int dir) {  // вызывать, пока имя name ещё живо в NameArena
+        if (enabled && is_dot(name_arena().view(name)) == false)
+            entries.insert({name, dir});
+    }
+
+    void remove(name_id name, int dir) {  // вызывать до того, как отпустить имя в NameArena
+        if (enabled && is_dot(name_arena().view(name)) == false)
+            entries.erase({name, dir});
+    }
+
+    // Все записи, чьё имя подходит под шаблон fnmatch(3); просматриваем только имена, начинающиеся с постоянной части шаблона
+    vector <name_entry> glob(const char *pattern) {
+        vector <name_entry> res;
+        string_view prefix(pattern, strcspn(pattern, "*?[\\"));
+        name_id last = NO_NAME;  // одинаковые имена идут подряд - шаблон проверяем один раз на имя
+        bool last_matched = false;
+        for (auto it = entries.lower_bound(prefix); it != entries.end(); it ++) {
+            string_view name = name_arena().view(it->name);
+            if (name.compare(0, prefix.size(), prefix) != 0)
+                break;  // диапазон имён с этим префиксом кончился
+            if (it->name != last) {
+                last = it->name;
+                last_matched = fnmatch(pattern, name_arena().str(it->name), 0) == 0;  // как find -name: '*' подходит и к именам с точкой в начале
+            }
+            if (last_matched)
+                res.push_back(*it);
+        }
+        return res;
+    }
+};
+
+
+// Один индекс имён на всю ФС
+static NameIndex &name_index() {
+    static NameIndex index;
+    return index;
+}
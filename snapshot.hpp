@@ -0,0 +1,91 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <string>
+#include <string_view>
+
+using namespace std;
+
+
+#define SNAPSHOT_MAGIC 0x32534d48534d5054ull  // "TPMSHMS2" - начало описания ФС в разделяемой памяти (2 - у inode есть флаг stub)
+#define SNAPSHOT_END 0x444e455350414e53ull  // "SNAPSEND" - конец: без него описание считается недописанным
+#define SNAPSHOT_NO_NUM ((uint64_t) -1)  // нет inode (родитель корня) или нет куска (дыра)
+#define SNAPSHOT_META_SUFFIX ".meta"  // описание лежит в отдельном объекте разделяемой памяти: /ИМЯ.meta
+
+
+
+// === Описание ФС (inode, директории, списки кусков) для перезапуска с разделяемой памятью ===
+// Сами байты файлов в описание не входят: они уже лежат в объекте разделяемой памяти, а кусок записан смещением своего буфера.
+// Формат - подряд идущие 64-битные числа и строки (длина + байты) в порядке, в котором их пишет shm_save (см. tmpfs.cpp).
+
+// Имя объекта разделяемой памяти: "/" + имя из ключа shm= + suffix
+static string shm_object(const char *name, const char *suffix) {
+    return string("/") + name + suffix;
+}
+
+
+struct snapshot_writer {
+    FILE *f;
+    bool ok;  // false - какая-то запись не удалась
+
+    snapshot_writer(FILE *_f) {
+        f = _f;
+        ok = f != NULL;
+    }
+
+    void u64(uint64_t v) {
+        ok = ok && fwrite(&v, sizeof(v), 1, f) == 1;
+    }
+
+    void str(string_view s) {
+        u64(s.size());
+        ok = ok && (s.size() == 0 || fwrite(s.data(), 1, s.size(), f) == s.size());
+    }
+
+    void time(const struct timespec &t) {
+        u64(t.tv_sec);
+        u64(t.tv_nsec);
+    }
+};
+
+
+struct snapshot_reader {
+    FILE *f;
+    bool ok;  // false - описание кончилось раньше времени или в нём некорректное значение
+
+    snapshot_reader(FILE *_f) {
+        f = _f;
+        ok = f != NULL;
+    }
+
+    uint64_t u64() {
+        uint64_t v = 0;
+        ok = ok && fread(&v, sizeof(v), 1, f) == 1;
+        return ok ? v : 0;
+    }
+
+    // Число, которое должно быть меньше limit (номер inode, куска и т.п.)
+    uint64_t index(uint64_t limit) {
+        uint64_t v = u64();
+        ok = ok && v < limit;
+        return ok ? v : 0;
+    }
+
+    string str(size_t max_len) {
+        size_t len = u64();
+        ok = ok && len <= max_len;
+        string s(ok ? len : 0, 0);
+        ok = ok && (len == 0 || fread(&s[0], 1, len, f) == len);
+        return s;
+    }
+
+    struct timespec time() {
+        struct timespec t;
+        t.tv_sec = u64();
+        t.tv_nsec = u64();
+        return t;
+    }
+};
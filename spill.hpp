@@ -0,0 +1,157 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <vector>
+#include <deque>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "rasserts.hpp"
+
+using namespace std;
+
+
+#define NO_SLOT ((size_t) -1)  // кусок не имеет копии в файле вытеснения
+
+
+
+// === Задание на запись одного куска в файл вытеснения ===
+struct spill_job {
+    void *owner;  // кусок, который вытесняем (NULL - кусок успели удалить, пока он записывался); поток записи это поле не трогает
+    uint8_t *bytes;  // что записываем: пока задание не завершено, этот буфер никто не меняет и не освобождает
+    size_t len;  // сколько байт записываем (не больше размера слота)
+    size_t slot;  // куда записываем: номер места в файле (смещение = slot * размер куска)
+    bool ok;  // удалась ли запись
+};
+
+
+
+// === Файл вытеснения: сюда уходят холодные куски данных, когда их в памяти становится слишком много ===
+// Место в файле делится на слоты по размеру куска. Запись идёт асинхронно - отдельным потоком,
+// а чтение (возврат куска в память) - синхронно, прямо в потоке запроса.
+struct SpillFile {
+    int fd;
+    size_t slot_size;
+    size_t n_slots;  // сколько слотов уже есть в файле
+    vector <size_t> free_slots;  // свободные слоты - их используем в первую очередь
+
+    mutex m;  // защищает todo, done и stop - остальное трогает только поток запросов
+    condition_variable cv;
+    deque <spill_job*> todo;  // задания, которые поток записи ещё не выполнил
+    vector <spill_job*> done;  // выполненные задания - их забирает поток запросов
+    bool stop;
+    thread writer;
+
+    SpillFile() {
+        fd = -1;
+        slot_size = 0;
+        n_slots = 0;
+        stop = false;
+    }
+
+    // Открываем файл вытеснения: path - либо директория (тогда в ней создаётся временный файл), либо путь к самому файлу
+    bool open_file(const char *path, size_t _slot_size) {
+        struct stat st;
+        if (stat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+            string tmpl = string(path) + "/tmpfs-spill-XXXXXX";
+            fd = mkstemp(&tmpl[0]);
+            if (fd >= 0)
+                unlink(tmpl.c_str());  // файл нужен только нам - пусть исчезнет вместе с процессом
+        } else {
+            fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+        }
+        if (fd < 0)
+            return false;
+
+        slot_size = _slot_size;
+        return true;
+    }
+
+    void start() {  // запускаем поток записи (см. tmpfs_init); задания, поставленные раньше, ждут в очереди
+        if (writer.joinable() == false)
+            writer = thread(&SpillFile::writer_loop, this);
+    }
+
+    size_t alloc_slot() {
+        if (free_slots.size() > 0) {
+            size_t slot = free_slots.back();
+            free_slots.pop_back();
+            return slot;
+        }
+        n_slots += 1;
+        return n_slots - 1;
+    }
+
+    void free_slot(size_t slot) {
+        rassert(slot != NO_SLOT, "Освобождаем несуществующий слот файла вытеснения!");
+        free_slots.push_back(slot);
+    }
+
+    // Ставим задание в очередь потоку записи
+    void submit(spill_job *job) {
+        lock_guard <mutex> lock(m);
+        todo.push_back(job);
+        cv.notify_one();
+    }
+
+    // Забираем выполненные задания
+    vector <spill_job*> take_done() {
+        lock_guard <mutex> lock(m);
+        vector <spill_job*> res;
+        res.swap(done);
+        return res;
+    }
+
+    // Синхронно читаем len байт слота в буфер bytes
+    bool read_slot(size_t slot, uint8_t *bytes, size_t len) {
+        return pread(fd, bytes, len, (off_t) (slot * slot_size)) == (ssize_t) len;
+    }
+
+    void writer_loop() {
+        while (1) {
+            spill_job *job;
+            {
+                unique_lock <mutex> lock(m);
+                cv.wait(lock, [this] { return stop || todo.size() > 0; });
+                if (todo.size() == 0)
+                    return;  // stop и делать больше нечего
+                job = todo.front();
+                todo.pop_front();
+            }
+
+            job->ok = pwrite(fd, job->bytes, job->len, (off_t) (job->slot * slot_size)) == (ssize_t) job->len;
+
+            lock_guard <mutex> lock(m);
+            done.push_back(job);
+        }
+    }
+
+    // Останавливаем поток записи (он успевает выполнить все задания из очереди; если потока не было - выполняем их сами)
+    void shutdown() {
+        {
+            lock_guard <mutex> lock(m);
+            if (stop)
+                return;
+            stop = true;
+            cv.notify_one();
+        }
+        if (writer.joinable())
+            writer.join();
+        else
+            writer_loop();
+    }
+
+    ~SpillFile() {
+        shutdown();
+        if (fd >= 0)
+            close(fd);
+    }
+};
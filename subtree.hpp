@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+
+using namespace std;
+
+
+
+// === Суммы по поддереву директории: сколько в нём байт данных, файлов и директорий ===
+// Используется и для самих сумм, и для изменений, которые ещё не разнесены по предкам (тогда поля могут быть отрицательными)
+struct subtree_totals {
+    int64_t bytes;  // суммарный размер файлов (st_size, дыры тоже считаются)
+    int64_t files;  // регулярные файлы
+    int64_t dirs;  // директории, не считая самой директории
+
+    subtree_totals() {
+        bytes = files = dirs = 0;
+    }
+
+    subtree_totals(int64_t _bytes, int64_t _files, int64_t _dirs) {
+        bytes = _bytes;
+        files = _files;
+        dirs = _dirs;
+    }
+
+    void operator += (const subtree_totals &other) {
+        bytes += other.bytes;
+        files += other.files;
+        dirs += other.dirs;
+    }
+
+    subtree_totals operator - () const {
+        return subtree_totals(-bytes, -files, -dirs);
+    }
+
+    bool empty() const {
+        return bytes == 0 && files == 0 && dirs == 0;
+    }
+
+    string str() const {
+        return "bytes=" + to_string(bytes) + " files=" + to_string(files) + " dirs=" + to_string(dirs) + "\n";
+    }
+};
@@ -0,0 +1,125 @@
+// tmcp ИСТОЧНИК НАЗНАЧЕНИЕ - копирование файла, которое внутри нашей ФС не копирует байты.
+// FUSE 2 не передаёт ФС copy_file_range, поэтому обычный cp читает и пишет файл целиком. tmcp, если оба файла лежат
+// в одной смонтированной tmpfs, просит ФС сделать копию через расширенный атрибут user.tmpfs.copy_from (куски файла
+// разделяются, см. file_data::copy_range); иначе (другая ФС, атрибут не поддерживается) копирует обычным образом.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <libgen.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+
+#include <string>
+
+using namespace std;
+
+
+// Корень файловой системы, в которой лежит существующий путь path: поднимаемся, пока не сменится устройство
+static string mount_root(const string &path) {
+    char real[PATH_MAX];
+    if (realpath(path.c_str(), real) == NULL)
+        return "";
+    string root = real;
+    struct stat st, up;
+    if (stat(root.c_str(), &st) != 0)
+        return "";
+    while (root != "/") {
+        string parent = root.substr(0, root.rfind('/'));
+        if (parent.size() == 0)
+            parent = "/";
+        if (stat(parent.c_str(), &up) != 0 || up.st_dev != st.st_dev)
+            break;
+        root = parent;
+    }
+    return root;
+}
+
+
+// Путь файла path относительно корня ФС root ("" - файл не внутри root)
+static string path_in(const string &root, const string &path) {
+    char real[PATH_MAX];
+    if (realpath(path.c_str(), real) == NULL)
+        return "";
+    string res = real;
+    if (root == "/")
+        return res;
+    if (res.compare(0, root.size(), root) != 0 || (res.size() > root.size() && res[root.size()] != '/'))
+        return "";
+    return res.size() == root.size() ? "/" : res.substr(root.size());
+}
+
+
+static int plain_copy(int in, int out) {
+    if (ftruncate(out, 0) != 0)
+        return -1;
+    char buf[1 << 16];
+    while (1) {
+        ssize_t got = read(in, buf, sizeof(buf));
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            return got;
+        for (ssize_t done = 0; done < got; ) {
+            ssize_t res = write(out, buf + done, got - done);
+            if (res < 0 && errno == EINTR)
+                continue;
+            if (res < 0)
+                return -1;
+            done += res;
+        }
+    }
+}
+
+
+int main(int argc, char **argv) {
+    if (argc != 3) {
+        fprintf(stderr, "Использование: %s ИСТОЧНИК НАЗНАЧЕНИЕ\n", argv[0]);
+        return 2;
+    }
+    string src = argv[1], dst = argv[2];
+    struct stat st;
+    if (stat(src.c_str(), &st) != 0) {
+        perror(src.c_str());
+        return 1;
+    }
+    if (S_ISREG(st.st_mode) == 0) {
+        fprintf(stderr, "%s: не обычный файл\n", src.c_str());
+        return 1;
+    }
+    struct stat dst_st;
+    if (stat(dst.c_str(), &dst_st) == 0 && S_ISDIR(dst_st.st_mode)) {  // как cp: в директорию - под тем же именем
+        string name = src;
+        dst += "/" + string(basename(&name[0]));
+    }
+
+    int in = open(src.c_str(), O_RDONLY);
+    int out = open(dst.c_str(), O_WRONLY | O_CREAT, st.st_mode & 07777);
+    if (in < 0 || out < 0) {
+        perror(in < 0 ? src.c_str() : dst.c_str());
+        return 1;
+    }
+
+    string root = mount_root(dst);  // атрибут статистики есть только у корня нашей ФС: на другой ФС с user-атрибутами
+    bool ours = root.size() > 0 && getxattr(root.c_str(), "user.tmpfs.spill", NULL, 0) >= 0;  // copy_from просто сохранился бы
+    string src_rel = ours ? path_in(root, src) : "";
+    if (src_rel.size() > 0 && fsetxattr(out, "user.tmpfs.copy_from", src_rel.data(), src_rel.size(), 0) == 0) {
+        close(in);
+        return close(out) == 0 ? 0 : 1;
+    }
+    if (src_rel.size() > 0 && errno != ENOTSUP && errno != EOPNOTSUPP) {  // ФС наша, но скопировать не смогла - не маскируем ошибку
+        perror(dst.c_str());
+        return 1;
+    }
+
+    if (plain_copy(in, out) != 0) {
+        perror(dst.c_str());
+        return 1;
+    }
+    close(in);
+    return close(out) == 0 ? 0 : 1;
+}
@@ -4,20 +4,33 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include <ctype.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
 
 #define FUSE_USE_VERSION 26
 #define HAVE_SYS_XATTR_H 0
 #include <fuse.h>
 #include <errno.h>
 #include <string.h>
+#include <stddef.h>
 
 #include <vector>
 #include <string>
 #include <iostream>
 #include <map>
+#include <unordered_map>
 
 #include "rasserts.hpp"
 #include "common.hpp"
+#include "names.hpp"
+#include "file_data.hpp"
+#include "cache.hpp"
+#include "import.hpp"
+#include "changes.hpp"
+#include "subtree.hpp"
+#include "snapshot.hpp"
+#include "writeback.hpp"
 
 
 #define PREFIX_IS_NOT_DIR -2  // ошибка, означающая, что префикс пути - не директория
@@ -30,47 +43,53 @@ using namespace std;
 
 // === Структура данных, хранящихся в каталоге (= директории) нашей файловой системы === 
 struct catalog_data {
-    map <string, int> files; // словарь пар: (имя файла/директории, его номер inode) -> доступ, удаление добавление в словарь - за O(log n)
+    unordered_map <name_id, int> files; // словарь пар: (номер имени в name_arena(), номер inode) -> доступ, удаление добавление в словарь - за O(1)
     size_t count;  // количество файлов в каталоге
+    int num;  // номер inode самого каталога - под ним записи лежат в name_index()
 
-    catalog_data() {
+    catalog_data(int _num) {
         count = 0;
+        num = _num;
     }
 
-    void add_file(string name, int num_inode) {  // добавляем файл (или под-директорию) name с номером num_inode
-        rassert(files.count(name) == 0, "Попытка добавить в каталог существующий файл!");
-        files.insert({name, num_inode});
-        count += 1;
-        return;
+    ~catalog_data() {
+        for (auto &entry: files) {
+            name_index().remove(entry.first, num);
+            name_arena().release(entry.first);
+        }
     }
 
-    void delete_file(string name) {  // удаляем файл (или под-директорию) с номером
-        rassert(files.count(name) == 1, "Попытка удалить из каталога несуществующий файл");
-        files.erase(name);
-        count -= 1;
+    int find(string_view name) {  // номер inode файла name или PATH_NOT_FOUND; память не выделяет
+        name_id id = name_arena().find(name);
+        if (id == NO_NAME)
+            return PATH_NOT_FOUND;  // такого имени нет ни в одной директории
+        auto it = files.find(id);
+        return it == files.end() ? PATH_NOT_FOUND : it->second;
     }
-};
-
-
 
-// === Структура данных файла ===
-struct file_data {
-    vector <uint8_t> data;  // данные - это вектор из байт = uint8_t
-    size_t size;  // количество байт данных
+    name_id find_name_of(int num_inode) {  // какое-нибудь имя файла num_inode в этом каталоге или NO_NAME; перебор всех записей
+        for (auto &entry: files)
+            if (entry.second == num_inode)
+                return entry.first;
+        return NO_NAME;
+    }
 
-    file_data() {
-        size = 0;
+    void add_file(string_view name, int num_inode) {  // добавляем файл (или под-директорию) name с номером num_inode
+        rassert(find(name) == PATH_NOT_FOUND, "Попытка добавить в каталог существующий файл!");
+        name_id id = name_arena().intern(name);
+        files.insert({id, num_inode});
+        name_index().add(id, num);
+        count += 1;
+        return;
     }
 
-    void add_byte(size_t i, uint8_t byte) {  // добавляем байт по индексу (=по смещению от начала файла) i в вектор 
-        rassert(i <= size, "Попытка писать за файлом!");
-        
-        if (i == size) {
-            data.push_back(byte);
-            size += 1;
-        } else {
-            data[i] = byte;
-        }
+    void delete_file(string_view name) {  // удаляем файл (или под-директорию) с номером
+        rassert(find(name) != PATH_NOT_FOUND, "Попытка удалить из каталога несуществующий файл");
+        name_id id = name_arena().find(name);
+        files.erase(id);
+        name_index().remove(id, num);
+        name_arena().release(id);
+        count -= 1;
     }
 };
 
@@ -86,6 +105,13 @@ struct INODE {
     uid_t uid;  // владелец и группа владельца
     gid_t gid;
     int opened_by;  // количество открытий 
+    time_t expire_at;  // когда файл должен быть удалён по истечении времени жизни (0 - никогда)
+    INODE *lru_prev, *lru_next;  // место в LRU-списке файлов (по времени последнего доступа) - по нему вытесняем файлы в режиме кэша
+    subtree_totals total;  // только у директорий: суммы по всему поддереву (без изменений из pending - см. TableInodes::tree_flush)
+    subtree_totals pending;  // только у директорий: изменения в самой директории, ещё не добавленные к total её и её предков
+    bool dirty;  // директория лежит в TableInodes::dirty_dirs
+    bool stub;  // режим кэша над нижней директорией: содержимое (записи директории или байты файла) ещё не прочитано оттуда
+    vector <int> *links;  // только у файла с несколькими именами: номера директорий, где они лежат (по номеру на имя); NULL - имя одно, и оно в par
 
     struct timespec st_atim;  // время последнего доступа к файлу (чтения его и тд) или содержимому директории;
                               // если мы просто удаляем файл из директории, это не меняем atim, тк как содержимое директории не было прочитано;
@@ -134,14 +160,29 @@ struct INODE {
     }
 
     INODE() {
+        mode = 0;
+        links = NULL;
+        reset();
+    }
+
+    void reset() {  // inode снова свободна: отпускаем данные и обнуляем поля (запись переиспользуется на месте)
+        clear();
+        data = NULL;
         num = 0;
         opened_by = 0;
         nlink = 0;
         par = NULL;
+        expire_at = 0;
+        lru_prev = lru_next = NULL;
+        total = pending = subtree_totals();
+        dirty = false;
+        stub = false;
+        delete links;
+        links = NULL;
         mode = 0;  // устаавливаем в 0 изначально - это значит, что пока эта inode - свободна: вообще ничего
     }
 
-    ~INODE() {
+    void clear() {
         if (mode == 0)  // если inode - ничего, не удаляем
             return;
 
@@ -151,6 +192,12 @@ struct INODE {
             delete((file_data *) data);
         else
             rassert(0, "Неизвестный тип Inode - попытка удаления!");
+        mode = 0;
+    }
+
+    ~INODE() {
+        clear();
+        delete links;
     }
 };
 
@@ -159,33 +206,189 @@ struct INODE {
 // === Структура для хранения в памяти созданных Inode ===
 struct TableInodes {
     vector <INODE*> inodes;  // тут лежат указатели на все созданные Inode - фактически это вся Файловая система + запас Inode для новых файлов
+    vector <INODE*> inode_blocks;  // сами записи: inode выделяются не по одной, а блоками - по блоку на каждое удвоение N
     vector <int> free_inodes;  // тут лежат индексы (и они же номер Inode) тех Inode, которые в данный момент свободны - то есть созданы, но не задействованы в файловой система 
     size_t N;  // полное колиество inode
+    ChunkStore store;  // куски данных всех файлов (и, если включено, их вытеснение в файл)
+
+    INODE lru_files;  // фиктивная голова LRU-списка файлов: lru_files.lru_next - самый свежий, lru_files.lru_prev - самый старый
+    TimerWheel wheel;  // сроки жизни файлов
+    ChangeFeed changes;  // журнал изменений (виртуальный файл CHANGES_PATH)
+    size_t cache_cap;  // режим кэша: сколько байт данных можно хранить, прежде чем вытеснять старые файлы (0 - без ограничений)
+    time_t default_ttl;  // время жизни новых файлов в секундах (0 - бесконечно)
+    size_t expired, evicted;  // сколько файлов удалено по сроку жизни и вытеснено по лимиту памяти
+    size_t expire_deferred;  // сколько раз файл с истёкшим сроком удалить было нельзя (отложили на WHEEL_RETRY секунд)
+    vector <int> dirty_dirs;  // директории с непустым pending (номер может повторяться, если inode удалили и создали заново)
+    const char *shm_name;  // -o shm=ИМЯ: данные лежат в разделяемой памяти и переживают перезапуск (NULL - обычная память)
+    Overlay *overlay;  // -o backing=ДИР: мы - кэш в памяти над этой директорией (NULL - обычная ФС в памяти)
 
     TableInodes() {
-        N = 10;
-        for (size_t i = 0; i < N; i ++)  // создаём N вершин
-            inodes.push_back(new INODE());
-        for (size_t i = 1; i < N; i ++)  // свободны все, кроме 0-ой Inode
-            free_inodes.push_back(i);
+        N = 0;
+        add_inodes(10);  // создаём 10 вершин
+        free_inodes.erase(free_inodes.begin());  // свободны все, кроме 0-ой Inode
         
         inodes[0]->uid = getuid();  // 0-ая Inode - это корень нашей файловой системы (он совпадает с той папкой, к которой монтируем файловую систему при запуске)
         inodes[0]->gid = getgid();
         inodes[0]->mode = 0777 | S_IFDIR;
-        catalog_data *data = new catalog_data();  // создаём структуру для корневой директории
+        catalog_data *data = new catalog_data(0);  // создаём структуру для корневой директории
         inodes[0]->data = data;
         data->add_file(".", 0);
         data->add_file("..", 0);  // . и .. в корневой директории ссылаются на саму себя
         inodes[0]->num = 0;
         inodes[0]->update_time(1, 1, 1);  // в момент создания всё времена устанавливаются!
+
+        lru_files.lru_prev = lru_files.lru_next = &lru_files;
+        cache_cap = 0;
+        default_ttl = 0;
+        expired = evicted = 0;
+        expire_deferred = 0;
+        shm_name = NULL;
+        overlay = NULL;
     }
 
-    void resize() {  // если текущее количество Inode не хватает - добавляем ещё
-        for (size_t i = N; i < 2 * N; i ++) {
-            inodes.push_back(new INODE());
-            free_inodes.push_back(i);
+    void lru_remove(INODE *inode) {
+        if (inode->lru_next == NULL)
+            return;
+        inode->lru_prev->lru_next = inode->lru_next;
+        inode->lru_next->lru_prev = inode->lru_prev;
+        inode->lru_prev = inode->lru_next = NULL;
+    }
+
+    void lru_touch(INODE *inode) {  // к файлу только что был доступ - делаем его самым свежим
+        lru_remove(inode);
+        if (inode->opened_by > 0 || inode->stub)
+            return;  // в списке только файлы, которые можно вытеснить: открытый вернётся в него при закрытии, заглушке вытеснять нечего
+        inode->lru_next = lru_files.lru_next;
+        inode->lru_prev = &lru_files;
+        lru_files.lru_next->lru_prev = inode;
+        lru_files.lru_next = inode;
+    }
+
+    void set_ttl(INODE *inode, time_t ttl) {  // файл будет удалён через ttl секунд (0 - никогда)
+        inode->expire_at = ttl > 0 ? time(NULL) + ttl : 0;
+        if (inode->expire_at != 0)
+            wheel.add(inode->num, inode->expire_at);
+    }
+
+    // === Суммы по поддеревьям (getfattr -n user.tmpfs.subtree директория) ===
+    // Файл учитывается один раз - в поддереве директории par (где его создали или куда последний раз переименовали),
+    // пока у него есть хотя бы одна ссылка; остальные жёсткие ссылки в суммы не входят (как в du). Если имя в par
+    // удалили, а другие ссылки остались, par переезжает в директорию одной из них (см. relink).
+    // Изменение не разносится сразу по всем предкам: оно копится в pending директории за O(1), а поднимается
+    // вверх по par только при чтении сумм - по разу на директорию, сколько бы записей в неё ни было.
+
+    void tree_add(INODE *dir, const subtree_totals &delta) {  // изменение внутри директории dir
+        dir->pending += delta;
+        if (dir->dirty == false) {
+            dir->dirty = true;
+            dirty_dirs.push_back(dir->num);
+            if (dirty_dirs.size() > 2 * N)
+                tree_flush();  // повторы от удалённых директорий не дают очереди расти без конца
         }
-        N *= 2;
+    }
+
+    subtree_totals tree_own(INODE *inode) {  // что inode добавляет к суммам своей директории
+        if (S_ISDIR(inode->mode) == 1)
+            return subtree_totals(inode->total.bytes, inode->total.files, inode->total.dirs + 1);  // pending поднимется сам - уже по новому пути
+        return subtree_totals(((file_data *) inode->data)->size, 1, 0);
+    }
+
+    void tree_attach(INODE *inode) {  // inode появилась в директории par
+        tree_add(inode->par, tree_own(inode));
+    }
+
+    void tree_detach(INODE *inode) {  // inode ушла из директории par (удалена или сейчас сменит par)
+        tree_add(inode->par, -tree_own(inode));
+    }
+
+    void tree_resized(INODE *inode, size_t old_size) {  // размер файла сменился с old_size
+        size_t size = ((file_data *) inode->data)->size;
+        if (size != old_size && inode->nlink > 0)
+            tree_add(inode->par, subtree_totals((int64_t) size - (int64_t) old_size, 0, 0));
+    }
+
+    // === Директории с именами файла (INODE::links): всё за O(числа имён файла), без обхода таблицы ===
+    void link_added(INODE *inode, INODE *dir) {  // в dir добавили ещё одно имя уже существующего файла (nlink уже увеличен)
+        if (inode->links == NULL)
+            inode->links = new vector <int> {inode->par->num};  // до этого имя было одно - в par
+        inode->links->push_back(dir->num);
+    }
+
+    void link_moved(INODE *inode, INODE *from, INODE *to) {  // одно из имён файла переименовали из from в to
+        if (inode->links != NULL)
+            *find(inode->links->begin(), inode->links->end(), from->num) = to->num;
+    }
+
+    // Из директории dir удалили одно из имён файла inode (nlink уже уменьшен): если в par имён не осталось,
+    // переносим par вместе с суммами в директорию, где имя файла есть
+    void relink(INODE *inode, INODE *dir) {
+        if (inode->links == NULL)
+            return;  // имя было одно - файл удалён (или это директория)
+        vector <int> &links = *inode->links;
+        auto it = find(links.begin(), links.end(), dir->num);
+        rassert(it != links.end(), "Имя файла удалено из директории, которой нет в его списке!");
+        links.erase(it);
+        if (inode->nlink > 0 && inode->par == dir && find(links.begin(), links.end(), dir->num) == links.end()) {
+            rassert(links.size() > 0, "У файла есть ссылки, но ни одна директория не содержит его имени!");
+            tree_detach(inode);
+            inode->par = inodes[links[0]];
+            tree_attach(inode);
+        }
+        if (links.size() <= 1) {
+            delete inode->links;  // осталось одно имя (оно в par) или ни одного
+            inode->links = NULL;
+        }
+    }
+
+    // Разносим все накопленные изменения по предкам: O(сумма глубин изменённых директорий)
+    void tree_flush() {
+        for (int num: dirty_dirs) {
+            INODE *dir = inodes[num];
+            if (dir->dirty == false)
+                continue;  // директорию удалили (а её pending уже не нужен) или уже разнесли
+            dir->dirty = false;
+            for (INODE *d = dir; d != NULL; d = d->par)
+                d->total += dir->pending;
+            dir->pending = subtree_totals();
+        }
+        dirty_dirs.clear();
+    }
+
+    // Считаем все суммы заново обходом всех inode (после импорта: содержимое файлов приходит отдельно от их inode)
+    void tree_rebuild() {
+        for (size_t i = 0; i < N; i ++) {
+            inodes[i]->total = inodes[i]->pending = subtree_totals();
+            inodes[i]->dirty = false;
+        }
+        dirty_dirs.clear();
+        for (size_t i = 1; i < N; i ++) {
+            INODE *inode = inodes[i];
+            if (inode->mode == 0 || inode->par == NULL || (S_ISREG(inode->mode) == 1 && inode->nlink == 0))
+                continue;
+            subtree_totals own = S_ISDIR(inode->mode) == 1 ? subtree_totals(0, 0, 1) : tree_own(inode);
+            for (INODE *d = inode->par; d != NULL; d = d->par)
+                d->total += own;
+        }
+    }
+
+    subtree_totals tree_totals(INODE *dir) {
+        tree_flush();
+        return dir->total;
+    }
+
+    // count новых свободных inode одним блоком: одно выделение памяти вместо count, и соседние номера лежат в памяти рядом
+    void add_inodes(size_t count) {
+        INODE *block = new INODE[count];
+        inode_blocks.push_back(block);
+        for (size_t i = 0; i < count; i ++) {
+            inodes.push_back(block + i);
+            free_inodes.push_back(N + i);
+        }
+        N += count;
+    }
+
+    void resize() {  // если текущее количество Inode не хватает - добавляем ещё
+        add_inodes(N);
     }
 
     int new_inode() {
@@ -196,38 +399,110 @@ struct TableInodes {
         return num;
     }
 
+    // Создаём в директории par_num новую директорию или файл (тип берётся из mode) с именем name; возвращаем номер новой inode
+    int make_node(int par_num, const string &name, mode_t mode, uid_t uid, gid_t gid) {
+        int new_num = new_inode();
+        INODE *inode = inodes[new_num];
+        INODE *par = inodes[par_num];
+
+        if (S_ISDIR(mode) == 1) {
+            catalog_data *data = new catalog_data(new_num);
+            data->add_file(".", new_num);
+            data->add_file("..", par_num);
+            par->nlink += 1;  // в родительскую директорию добавилась ссылка ".."
+            inode->data = data;
+            inode->nlink = 2;  // изначально 2 ссылки - из родительской директории и "." - указывает на саму же директорию
+        } else {
+            inode->data = new file_data(&store);
+            inode->nlink = 1;  // изначально 1 ссылка - из родительской директории
+        }
+        inode->mode = mode;
+        inode->uid = uid;
+        inode->gid = gid;
+        inode->num = new_num;
+        inode->par = par;
+        inode->update_time(1, 1, 1);  // устанвливаем время - при создании
+        if (S_ISREG(mode) == 1) {
+            set_ttl(inode, default_ttl);
+            lru_touch(inode);
+        }
+
+        ((catalog_data *) par->data)->add_file(name, new_num);  // добавили в родительскую директорию новую запись
+        par->update_time(0, 1, 1);  // в директории появился новый файл -> время изменено: mtim меняется, так как жанные директории изменены - новый файл, ctim меняется, так как меняется счётчик файлов...
+        tree_attach(inode);
+        return new_num;
+    }
+
     void delete_inode(int num_inode) {  // удаляем inode по номеру
-        delete inodes[num_inode];  // удаляем старую Inode
-        inodes[num_inode] = new INODE();  // создаём взамен новую, свободную
+        lru_remove(inodes[num_inode]);
+        if (overlay != NULL) {
+            overlay->files.erase(num_inode);  // незаписанные изменения удалённого файла уже не нужны
+            overlay->forget_link(num_inode);
+        }
+        inodes[num_inode]->reset();  // удаляем данные старой Inode - запись снова свободна
         free_inodes.push_back(num_inode);  // возвращаем номер в список свободных inode
     }
     
+    // Разбираем задания, которые выполнили потоки записи в нижнюю директорию: отпускаем их куски и запоминаем ошибки
+    void overlay_reap() {
+        for (wb_job *job: overlay->wb.take_done()) {
+            for (wb_piece &piece: job->pieces) {
+                if (piece.owner != NULL)
+                    store.unpin((chunk *) piece.owner);
+                if (piece.index * job->chunk_size < job->size)
+                    overlay->flushed_bytes += min(job->chunk_size, job->size - piece.index * job->chunk_size);
+            }
+            auto it = overlay->files.find(job->num);
+            if (job->op == WB_DATA && it != overlay->files.end() && it->second.serial == job->serial) {
+                it->second.jobs -= 1;
+                if (job->err != 0)
+                    it->second.failed(job, time(NULL));  // в памяти - единственная копия изменений: файл остаётся грязным
+                else if (it->second.jobs == 0 && it->second.dirty() == false && it->second.error == 0)
+                    overlay->files.erase(it);  // всё записано - файл снова чистый
+            }
+            overlay->flushed_ops += 1;
+            if (job->err != 0) {
+                overlay->errors += 1;
+                if (job->op != WB_DATA && overlay->error == 0)
+                    overlay->error = job->err;  // ошибку содержимого получит fsync самого файла (см. wb_file::failed)
+                fprintf(stderr, "tmpfs: не удалось перенести изменение %s в нижнюю директорию: %s\n", job->path.c_str(), strerror(job->err));
+            }
+            delete job;
+        }
+        store.reclaim();
+    }
+
     ~TableInodes() {
-        for (size_t i = 0; i < N; i ++)
-            delete inodes[i];
+        if (overlay != NULL) {
+            overlay->wb.shutdown();  // дожидаемся потоков записи и отпускаем куски оставшихся заданий
+            overlay_reap();
+            delete overlay;
+        }
+        for (INODE *block: inode_blocks)
+            delete[] block;
     }
 };
 
 
+static void overlay_populate(INODE *dir);
+
 // По пути _path внутри нашей ФС получаем номер inode, которая соответствует пути:
 static int get_num_inode_by_path(const char *_path) {
-    string path = construct_path(_path);  // получаем путь в удобном виде
-    if (path == "/")  // если путь - просто корень, то номер корня - это 0:
-        return 0;
+    int curr_num_inode = 0;  // пока что текущий inode - 0-ой (то есть корневая директория); путь "/" - это сразу он
 
-    int curr_num_inode = 0;  // пока что текущий inode - 0-ой (то есть корневая директория)
-
-    for (string token: str_split(path, "/")) {  
+    path_tokens tokens(_path);  // идём по компонентам пути, ничего не копируя
+    string_view token;
+    while (tokens.next(token)) {
         INODE *inode = TMPFS_DATA->inodes[curr_num_inode];  // получаем текущую inode
 
         if (S_ISDIR(inode->mode) == 0)
             return PREFIX_IS_NOT_DIR;  // префикс пути - не директория
+        if (inode->stub)
+            overlay_populate(inode);  // в директории ещё не было поиска - читаем её из нижней директории
 
-        catalog_data *data = (catalog_data *) inode->data;
-        if (data->files.count(token) == 0)
+        curr_num_inode = ((catalog_data *) inode->data)->find(token);  // переходим по пути к следующей inode -> её номер берём
+        if (curr_num_inode == PATH_NOT_FOUND)
             return PATH_NOT_FOUND;  // не нашли name -> некорректный путь
-
-        curr_num_inode = data->files[token];  // переходим по пути к следующей inode -> её номер берём
     }
 
     return curr_num_inode;
@@ -254,10 +529,560 @@ static bool check_X_in_path(const char *path, bool start_from_prefix=0) {
 }
 
 
+// Путь - это виртуальный файл журнала изменений (он есть, только если журнал включён):
+static bool is_changes(const char *path) {
+    return path != NULL && TMPFS_DATA->changes.enabled() && strcmp(path, CHANGES_PATH) == 0;
+}
+
+// Журнал показывает пути и изменения во всём дереве, поэтому открыть его может только владелец корня ФС (и root):
+static bool changes_allowed() {
+    uid_t curr_uid = fuse_get_context()->uid;
+    return curr_uid == 0 || curr_uid == TMPFS_DATA->inodes[0]->uid;
+}
+
+
+// Номер директории, в которой лежит inode (для корня - сам корень):
+static int parent_num(INODE *inode) {
+    return inode->par != NULL ? inode->par->num : 0;
+}
+
+
+// Путь к inode от корня - для журнала изменений, когда FUSE не передал нам путь (удаление по сроку жизни или лимиту);
+// имя ищем перебором родительской директории, поэтому для частых операций не годится
+static string inode_path(INODE *inode) {
+    string path = "";
+    while (inode->par != NULL) {
+        for (auto &entry: ((catalog_data *) inode->par->data)->files) {
+            string_view name = name_arena().view(entry.first);
+            if (entry.second == inode->num && name != "." && name != "..") {
+                path = "/" + string(name) + path;
+                break;
+            }
+        }
+        inode = inode->par;
+    }
+    return path == "" ? "/" : path;
+}
+
+
+// === Поиск по индексу имён: виртуальная директория FIND_PATH ===
+// ls FIND_PATH/'lib*.so' - в листинге все пути, чьё последнее имя подходит под шаблон; в каждом пути '/' и '\\'
+// записаны как \057 и \134 (имя в директории не может содержать '/'). Через такое имя можно сделать stat, open, truncate и opendir -
+// обращение уходит к настоящему файлу.
+
+// Что идёт в пути после FIND_PATH: "" - сама FIND_PATH, "шаблон" или "шаблон/найденный_путь"; NULL - путь не относится к поиску
+static const char *find_query(const char *path) {
+    size_t len = strlen(FIND_PATH);
+    if (path == NULL || name_index().enabled == false || strncmp(path, FIND_PATH, len) != 0)
+        return NULL;
+    if (path[len] == 0)
+        return path + len;
+    return path[len] == '/' ? path + len + 1 : NULL;  // /.findings - обычный файл
+}
+
+
+// Запрос - сама директория результатов (FIND_PATH или FIND_PATH/шаблон), а не один из найденных путей
+static bool find_is_listing(const char *query) {
+    return strchr(query, '/') == NULL;
+}
+
+
+// Настоящий путь, который скрывается за FIND_PATH/шаблон/имя (пустая строка, если имя некорректно)
+static string find_target(const char *query) {
+    const char *name = strchr(query, '/');
+    if (name == NULL || name[1] == 0 || strchr(name + 1, '/') != NULL)
+        return "";  // сама директория результатов или лишние компоненты пути
+    name += 1;
+    string path = "/";
+    for (const char *c = name; *c != 0; c ++) {
+        if (strncmp(c, "\\057", 4) == 0 || strncmp(c, "\\134", 4) == 0) {
+            path += c[1] == '0' ? '/' : '\\';
+            c += 3;
+        } else {
+            path += *c;
+        }
+    }
+    return path;
+}
+
+
+// Директория из результатов поиска: путь к ней от корня ("" у корня) и можно ли пользователю видеть её содержимое
+struct find_dir {
+    string path;
+    bool reachable;  // есть X бит на всём пути до неё включительно
+};
+
+static find_dir &find_lookup_dir(int num, unordered_map <int, find_dir> &memo) {  // одни и те же директории встречаются в результатах много раз
+    auto it = memo.find(num);
+    if (it != memo.end())
+        return it->second;
+
+    INODE *dir = TMPFS_DATA->inodes[num];
+    find_dir res;
+    res.path = "";
+    res.reachable = dir->check_mode(0, 0, 1);
+    if (dir->par != NULL) {
+        find_dir &par = find_lookup_dir(dir->par->num, memo);
+        res.reachable = res.reachable && par.reachable;
+        for (auto &entry: ((catalog_data *) dir->par->data)->files) {
+            string_view name = name_arena().view(entry.first);
+            if (entry.second == num && NameIndex::is_dot(name) == false) {
+                res.path = par.path + "/" + string(name);
+                break;
+            }
+        }
+    }
+    return memo[num] = res;
+}
+
+
+// Выполняем поиск: имена для листинга FIND_PATH/pattern (только из директорий, которые пользователь может прочитать)
+static vector <string> *find_run(const char *pattern) {
+    vector <string> *res = new vector <string>();
+    if (pattern[0] == 0)
+        return res;  // сама FIND_PATH пустая
+
+    unordered_map <int, find_dir> memo;
+    for (name_entry entry: name_index().glob(pattern)) {
+        find_dir &dir = find_lookup_dir(entry.dir, memo);
+        if (dir.reachable == false || TMPFS_DATA->inodes[entry.dir]->check_mode(1, 0, 0) == 0)
+            continue;
+        string name = "";
+        string path = dir.path + "/" + name_arena().str(entry.name);
+        for (size_t i = 1; i < path.size(); i ++) {  // первый '/' не пишем
+            if (path[i] == '/')
+                name += "\\057";
+            else if (path[i] == '\\')
+                name += "\\134";
+            else
+                name += path[i];
+        }
+        res->push_back(name);
+    }
+    return res;
+}
+
+
+// === Режим кэша над нижней директорией: -o backing=ДИР ===
+// Изменения делаются в памяти и сразу подтверждаются, а в нижнюю директорию их по порядку переносят потоки записи (writeback.hpp):
+// изменение пространства имён ставится в очередь в момент операции, а содержимое файлов - раз в delay секунд, при последнем
+// закрытии файла и при fsync; все записи в один кусок за это время уходят в нижний файл одной записью.
+// Нижняя директория читается лениво: директория - целиком при первом поиске в ней, содержимое файла - при первом открытии.
+// Чистый файл при нехватке памяти (cache_cap) или по сроку жизни не удаляется - из памяти выбрасывается только его содержимое.
+
+// Ставим в очередь изменение пространства имён; права, владельца и времена берём из inode
+static void overlay_op(int op, const char *path, INODE *inode, const char *path2 = "") {
+    Overlay *overlay = TMPFS_DATA->overlay;
+    if (overlay == NULL)
+        return;
+    wb_job *job = new wb_job();
+    job->op = op;
+    job->path = path;
+    job->path2 = path2;
+    if (inode != NULL) {
+        job->mode = inode->mode;
+        job->uid = inode->uid;
+        job->gid = inode->gid;
+        job->times[0] = inode->st_atim;
+        job->times[1] = inode->st_mtim;
+    }
+    overlay->wb.submit(job);
+}
+
+
+// Содержимое файла изменилось: байты [off, off + len) и/или размер (до изменения - old_size)
+static void overlay_written(INODE *inode, size_t old_size, size_t off, size_t len) {
+    Overlay *overlay = TMPFS_DATA->overlay;
+    if (overlay == NULL || inode->nlink == 0)
+        return;  // у удалённого файла в нижней директории уже нет имени
+    auto it = overlay->files.find(inode->num);
+    if (it == overlay->files.end()) {
+        wb_file file;
+        file.min_size = old_size;
+        file.serial = overlay->next_serial ++;
+        it = overlay->files.insert({inode->num, file}).first;
+    }
+    wb_file &file = it->second;
+    size_t size = ((file_data *) inode->data)->size;
+    if (size != old_size || len == 0) {  // truncate до того же размера всё равно меняет mtime
+        file.resized = true;
+        file.min_size = min(file.min_size, size);
+    }
+    for (size_t i = off / CHUNK_SIZE; len > 0 && i <= (off + len - 1) / CHUNK_SIZE; i ++)
+        file.chunks.insert(i);
+}
+
+
+// У файла не осталось имён - записывать его изменения некуда
+static void overlay_forget(INODE *inode) {
+    if (TMPFS_DATA->overlay != NULL && inode->nlink == 0)
+        TMPFS_DATA->overlay->files.erase(inode->num);
+}
+
+
+// Пути файлов от корня ФС: имя файла ищем перебором его директории - по разу на директорию, сколько бы файлов в ней ни изменилось.
+// У файла с именами par - директория, где одно из них лежит (см. TableInodes::relink); если имени там всё же нет,
+// смотрим остальные директории с его именами (INODE::links). Пустая строка - у файла не осталось ни одного имени
+static vector <string> overlay_paths(const vector <INODE*> &files) {
+    unordered_map <int, unordered_map <int, name_id>> names;  // директория -> (inode -> имя в ней)
+    unordered_map <int, string> dir_paths;
+    auto path_in = [&](INODE *par, INODE *inode) -> string {  // путь через имя в директории par ("" - его там нет)
+        int dir = par->num;
+        if (names.count(dir) == 0) {
+            unordered_map <int, name_id> &dir_names = names[dir];
+            for (auto &entry: ((catalog_data *) par->data)->files)
+                dir_names.insert({entry.second, entry.first});
+            dir_paths[dir] = dir == 0 ? "" : inode_path(par);
+        }
+        auto it = names[dir].find(inode->num);
+        return it != names[dir].end() ? dir_paths[dir] + "/" + name_arena().str(it->second) : "";
+    };
+
+    vector <string> res;
+    for (INODE *inode: files) {
+        string path = inode->nlink > 0 ? path_in(inode->par, inode) : "";
+        for (size_t i = 0; path.size() == 0 && inode->links != NULL && i < inode->links->size(); i ++)
+            path = path_in(TMPFS_DATA->inodes[(*inode->links)[i]], inode);
+        res.push_back(path);
+    }
+    return res;
+}
+
+
+// Отдаём потокам записи накопленные изменения содержимого: only - одного файла, -1 - всех. Байты не копируются:
+// задание держит сами куски (ChunkStore::pin), а запись в файл после этого сделает себе копию куска.
+// Файлы, чья прошлая запись не удалась, ждут wb_file::retry_at; force - повторяем и их сразу
+static void overlay_flush(int only, bool force=0) {
+    TableInodes *table = TMPFS_DATA;
+    Overlay *overlay = table->overlay;
+    table->overlay_reap();
+
+    vector <INODE*> files;
+    time_t now = time(NULL);
+    for (auto it = only >= 0 ? overlay->files.find(only) : overlay->files.begin(); it != overlay->files.end(); it ++) {
+        if (it->second.dirty() && it->second.jobs == 0 && (force || it->second.retry_at <= now))  // пока прошлое задание файла не завершено, новое не отдаём
+            files.push_back(table->inodes[it->first]);
+        if (only >= 0)
+            break;
+    }
+    vector <string> paths = overlay_paths(files);
+
+    for (size_t k = 0; k < files.size(); k ++) {
+        INODE *inode = files[k];
+        wb_file &file = overlay->files[inode->num];
+        file_data *data = (file_data *) inode->data;
+        if (paths[k].size() == 0)
+            continue;  // имён не осталось - изменения отменит overlay_forget
+
+        wb_job *job = new wb_job();
+        job->op = WB_DATA;
+        job->path = paths[k];
+        job->num = inode->num;
+        job->serial = file.serial;
+        job->size = data->size;
+        job->min_size = file.min_size;
+        job->chunk_size = CHUNK_SIZE;
+        job->times[0] = inode->st_atim;
+        job->times[1] = inode->st_mtim;
+        vector <size_t> unread;  // куски, которые не удалось прочитать из файла вытеснения - попробуем в следующий раз
+        for (size_t i: file.chunks) {
+            if (i >= data->chunks.size())
+                continue;  // кусок уже отрезан - хватит ftruncate
+            chunk *c = data->chunks[i];
+            wb_piece piece = {i, NULL, 0, c};
+            if (c != NULL) {
+                piece.bytes = table->store.pin(c);
+                piece.cap = c->cap;
+            }
+            if (c != NULL && piece.bytes == NULL)
+                unread.push_back(i);
+            else
+                job->pieces.push_back(piece);
+        }
+        file.chunks.clear();
+        file.chunks.insert(unread.begin(), unread.end());
+        file.resized = false;
+        file.min_size = data->size;
+        file.retry_at = 0;
+        file.jobs += 1;
+        file.last_job = overlay->wb.submit(job);
+    }
+    table->store.balance();
+}
+
+
+// В начале операций: разбираем выполненные задания и раз в delay секунд отдаём изменения содержимого
+static void overlay_maintain() {
+    Overlay *overlay = TMPFS_DATA->overlay;
+    if (overlay == NULL)
+        return;
+    TMPFS_DATA->overlay_reap();
+    time_t now = time(NULL);
+    if (now - overlay->last_flush >= overlay->delay) {
+        overlay->last_flush = now;
+        overlay_flush(-1);
+    }
+}
+
+
+// fsync: ждём, пока в нижнюю директорию попадёт всё, что изменилось до вызова (only - содержимое этого файла, -1 - всех);
+// возвращаем первую ошибку с прошлого fsync: для файла - ошибку записи его содержимого, для -1 (fsync директории) -
+// ошибку изменения пространства имён. Запись, которая не удалась, повторяем один раз сразу (force),
+// а если не удалась и она - файл остаётся грязным до следующего повтора (wb_file::retry_at), а fsync возвращает ошибку
+static int overlay_sync(int only) {
+    Overlay *overlay = TMPFS_DATA->overlay;
+    if (overlay == NULL)
+        return 0;
+    for (bool force = 1; ; force = 0) {
+        overlay_flush(only, force);
+        if (only < 0)
+            overlay->wb.wait_idle();
+        else if (overlay->files.count(only) > 0)
+            overlay->wb.wait_job(overlay->files[only].last_job);  // задание файла выполнится после всех изменений путей перед ним
+        TMPFS_DATA->overlay_reap();
+        bool clean = true;  // файл мог быть пропущен, пока у потоков было его прошлое задание - тогда ещё круг
+        time_t now = time(NULL);
+        for (auto &entry: overlay->files)
+            if ((only < 0 || entry.first == only) && (entry.second.jobs > 0 || (entry.second.dirty() && entry.second.retry_at <= now)))
+                clean = false;
+        if (clean)
+            break;
+    }
+    int err = 0;
+    if (only < 0) {
+        err = overlay->error;
+        overlay->error = 0;
+    } else if (overlay->files.count(only) > 0) {
+        wb_file &file = overlay->files[only];
+        err = file.error;
+        file.error = 0;
+        if (file.jobs == 0 && file.dirty() == false)
+            overlay->files.erase(only);
+    }
+    return -err;
+}
+
+
+// Сейчас удалится последнее наше имя файла. Если в нижней директории у него несколько ссылок (см. overlay_populate), то имена
+// в ещё не прочитанных директориях останутся - незаписанные изменения содержимого должны дойти до них, а не пропасть.
+// Сама inode (она может быть ещё открыта) к этим именам больше не относится: при чтении их директорий заведём новую
+static void overlay_keep_data(INODE *inode) {
+    Overlay *overlay = TMPFS_DATA->overlay;
+    if (overlay == NULL || inode->nlink != 1 || overlay->link_keys.count(inode->num) == 0)
+        return;
+    if (overlay->files.count(inode->num) > 0)
+        overlay_sync(inode->num);  // ошибка останется в stderr: файла с этим именем после unlink всё равно не будет
+    overlay->forget_link(inode->num);
+}
+
+
+// Перед чтением из нижней директории по пути path: ждём только отложенные изменения пространства имён, которые касаются
+// этого пути (переименования директорий на пути к нему и т.п.), а не всю очередь с содержимым файлов
+static void overlay_wait_path(const string &path) {
+    TableInodes *table = TMPFS_DATA;
+    table->overlay->wb.wait_job(table->overlay->wb.last_touching(path));
+    table->overlay_reap();
+}
+
+
+// Директория из нижней директории: при первом поиске в ней заводим inode для всех её записей (содержимое файлов - см. overlay_fill).
+// Символьные ссылки, устройства и т.п. пропускаем. Жёсткие ссылки узнаём по (st_dev, st_ino): если имя того же файла
+// уже встречалось в другой прочитанной директории, новое имя ссылается на ту же inode (nlink считает только прочитанные имена)
+static void overlay_populate(INODE *dir) {
+    TableInodes *table = TMPFS_DATA;
+    Overlay *overlay = table->overlay;
+    string rel = inode_path(dir);
+    overlay_wait_path(rel);  // путь в нижней директории должен совпадать с нашим
+    string path = overlay->wb.root + rel;
+    DIR *d = opendir(path.c_str());
+    if (d == NULL) {
+        perror(path.c_str());
+        return;  // останется заглушкой - попробуем при следующем поиске
+    }
+
+    struct timespec mtim = dir->st_mtim, ctim = dir->st_ctim;
+    struct dirent *ent;
+    while ((ent = readdir(d)) != NULL) {
+        struct stat st;
+        if (NameIndex::is_dot(ent->d_name) || fstatat(dirfd(d), ent->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+            continue;
+        if ((S_ISDIR(st.st_mode) == 0 && S_ISREG(st.st_mode) == 0) || ((catalog_data *) dir->data)->find(ent->d_name) != PATH_NOT_FOUND)
+            continue;
+        bool linked = S_ISREG(st.st_mode) == 1 && st.st_nlink > 1;
+        auto known = linked ? overlay->links.find({st.st_dev, st.st_ino}) : overlay->links.end();
+        if (known != overlay->links.end()) {  // ещё одно имя файла, который у нас уже есть
+            ((catalog_data *) dir->data)->add_file(ent->d_name, known->second);
+            table->inodes[known->second]->nlink += 1;
+            table->link_added(table->inodes[known->second], dir);
+            continue;
+        }
+        INODE *inode = table->inodes[table->make_node(dir->num, ent->d_name, st.st_mode, st.st_uid, st.st_gid)];
+        inode->stub = true;
+        table->lru_remove(inode);
+        if (linked)
+            overlay->add_link(inode->num, st.st_dev, st.st_ino);
+        inode->st_atim = st.st_atim;
+        inode->st_mtim = st.st_mtim;
+        inode->st_ctim = st.st_ctim;
+        if (S_ISREG(st.st_mode) == 1) {
+            ((file_data *) inode->data)->resize(st.st_size);  // пока одни дыры - памяти не занимают
+            table->tree_resized(inode, 0);
+        }
+    }
+    closedir(d);
+    dir->st_mtim = mtim;  // make_node обновил времена директории, а она не менялась
+    dir->st_ctim = ctim;
+    dir->stub = false;
+    overlay->loaded_dirs += 1;
+}
+
+
+// Содержимое файла из нижней директории - при первом обращении к нему (open, truncate, копирование, контрольная сумма)
+static int overlay_fill(INODE *inode) {
+    if (inode->stub == false || S_ISREG(inode->mode) == 0)
+        return 0;
+    TableInodes *table = TMPFS_DATA;
+    string rel = inode_path(inode);
+    overlay_wait_path(rel);
+    string path = table->overlay->wb.root + rel;
+    int fd = open(path.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        int err = errno;
+        if (fd >= 0)
+            close(fd);
+        return -err;
+    }
+
+    file_data *data = (file_data *) inode->data;
+    size_t old_size = data->size;
+    bool ok = data->load(fd, st.st_size);  // файл могли изменить в обход нас - размер берём свежий
+    int err = errno;
+    close(fd);
+    if (ok == false)
+        data->resize(st.st_size);  // остаётся заглушкой
+    table->tree_resized(inode, old_size);
+    if (ok == false)
+        return -err;
+    inode->stub = false;
+    table->overlay->loaded_files += 1;
+    table->lru_touch(inode);
+    return 0;
+}
+
+
+// Вместо удаления чистого файла (режим кэша) выбрасываем из памяти его содержимое - при следующем открытии оно прочитается заново
+static bool overlay_drop(INODE *inode) {
+    Overlay *overlay = TMPFS_DATA->overlay;
+    if (S_ISREG(inode->mode) == 0 || inode->stub || inode->nlink == 0 || overlay->files.count(inode->num) > 0)
+        return false;  // уже выброшен или изменения ещё не записаны в нижнюю директорию
+    file_data *data = (file_data *) inode->data;
+    size_t size = data->size;
+    data->resize(0);
+    data->resize(size);
+    inode->stub = true;
+    TMPFS_DATA->lru_remove(inode);
+    overlay->dropped += 1;
+    return true;
+}
+
+
+// Удаляем запись name о файле с номером inode num из директории dir (все проверки уже сделаны);
+// у файла с жёсткими ссылками dir может и не быть его par
+static void unlink_entry(int num, INODE *dir, const string &name) {
+    INODE *inode = TMPFS_DATA->inodes[num];
+    ((catalog_data *) dir->data)->delete_file(name);  // удаляем файл из родительского каталога
+    inode->nlink -= 1;  // удаляем файл = уменьшаем количетсво ссылок (так как "имя файла" в директории - тоже жёсткая ссылка) на него
+    dir->update_time(0, 1, 1);  // в родительском каталоге удалился файл -> обновляем время
+    inode->update_time(0, 0, 1);  // файл не читали, а лишь изменили метаданные - кол-во ссылок
+    TMPFS_DATA->relink(inode, dir);  // удалили имя, через которое файл учтён в суммах, - учитываем через оставшееся
+    if (inode->nlink == 0) {
+        TMPFS_DATA->tree_detach(inode);  // последняя ссылка: открытый файл ещё живёт, но в дереве его уже нет
+        overlay_forget(inode);
+    }
+
+    if (inode->opened_by == 0 && inode->nlink == 0)  // если файл не открыт и на файл не ссылается -> очищаем память
+        TMPFS_DATA->delete_inode(num);
+}
+
+
+// Удаляем файл по инициативе самой ФС (истёк срок жизни или не хватает памяти) - так же, как это сделал бы unlink
+// для каждого его имени: у файла с жёсткими ссылками одно из имён всегда лежит в par (см. relink)
+static bool evict_file(int num) {
+    INODE *inode = TMPFS_DATA->inodes[num];
+    if (TMPFS_DATA->overlay != NULL)
+        return overlay_drop(inode);  // файл есть в нижней директории - удалять его не нужно
+    if (S_ISREG(inode->mode) == 0 || inode->nlink == 0)
+        return false;
+
+    while (1) {
+        INODE *dir = inode->par;
+        name_id name = ((catalog_data *) dir->data)->find_name_of(num);
+        rassert(name != NO_NAME, "У файла есть ссылки, но в par его нет!");
+        string path = inode_path(inode);
+        bool last = inode->nlink == 1;  // после последнего unlink_entry inode может освободиться
+        TMPFS_DATA->changes.add("evict", num, dir->num, path.c_str());
+        unlink_entry(num, dir, string(name_arena().view(name)));
+        if (last)
+            return true;
+    }
+}
+
+
+// Режим кэша: если данных больше лимита, удаляем давно не использованные файлы, пока не уложимся в лимит.
+// Открытых файлов и заглушек в LRU-списке нет (см. lru_touch); остальные файлы, которые сейчас вытеснить нельзя
+// (с незаписанными в нижнюю директорию изменениями), переносим в начало списка и за вызов пропускаем не больше
+// CACHE_SCAN_LIMIT штук - иначе, когда лимит недостижим, каждая запись обходила бы все файлы
+static const int CACHE_SCAN_LIMIT = 64;
+
+static void cache_enforce_cap() {
+    TableInodes *table = TMPFS_DATA;
+    if (table->cache_cap == 0)
+        return;
+
+    int skipped = 0;
+    INODE *inode = table->lru_files.lru_prev;  // начинаем с самого старого
+    while (table->store.stored > table->cache_cap && inode != &table->lru_files && skipped < CACHE_SCAN_LIMIT) {
+        INODE *prev = inode->lru_prev;  // запоминаем заранее: inode может быть удалена или переехать в начало
+        if (evict_file(inode->num)) {
+            table->evicted += 1;
+        } else {
+            table->lru_touch(inode);
+            skipped += 1;
+        }
+        inode = prev;
+    }
+}
+
+
+// Удаляем файлы, чей срок жизни истёк, и следим за лимитом памяти. Вызывается в начале операций, с которых начинается
+// любое обращение к ФС (getattr, open, ...), поэтому истёкший файл никто не увидит
+static void cache_maintain() {
+    TableInodes *table = TMPFS_DATA;
+    overlay_maintain();
+    time_t now = time(NULL);
+    for (wheel_entry entry: table->wheel.advance(now)) {
+        INODE *inode = table->inodes[entry.num];
+        if (S_ISREG(inode->mode) == 0 || inode->nlink == 0 || inode->expire_at != entry.expire)
+            continue;  // срок мог смениться, а номер - освободиться
+        if (evict_file(entry.num)) {
+            table->expired += 1;
+        } else {
+            table->wheel.add(entry.num, entry.expire, now + WHEEL_RETRY);  // например, изменения ещё не записаны в нижнюю директорию
+            table->expire_deferred += 1;
+        }
+    }
+    cache_enforce_cap();
+}
+
+
 // Функция для создания директории (вызывается при вызове команды mkdir, например):
 int tmpfs_mkdir(const char *_path, mode_t mode) {
-    if (get_num_inode_by_path(_path) >= 0)
+    cache_maintain();
+    if (get_num_inode_by_path(_path) >= 0 || is_changes(_path))
         return -EEXIST;  // путь уже есть (необязательно директория)
+    if (find_query(_path) != NULL)
+        return -EACCES;  // директория поиска - только для чтения
 
     string prefix, dir;
     get_prefix_and_name(_path, prefix, dir);
@@ -271,28 +1096,9 @@ int tmpfs_mkdir(const char *_path, mode_t mode) {
         return -EACCES;  // в пути нет X-бита бита, нет права на запись в родительской директории
 
     // теперь у нас еть prefix-директория с номером inode = num - в ней мы создаём директорию dir
- 
-    int new_num = TMPFS_DATA->new_inode();  // создали новую inode для директории dir
-    INODE* new_inode = TMPFS_DATA->inodes[new_num];
-    INODE *pref_inode = TMPFS_DATA->inodes[num];
-
-    catalog_data *new_data = new catalog_data();  // данные dir
-    new_data->add_file(".", new_num);
-    new_data->add_file("..", num);
-    pref_inode->nlink += 1;  // в prefi директорию добавилась ссылка ".."
-
-    new_inode->data = new_data;
-    new_inode->nlink = 2;  // изначально 2 ссылки - из prefix-директории и "." - указывает на саму же директорию
-    new_inode->mode = (mode & ~fuse_get_context()->umask) | S_IFDIR;  // отмечаем, что данная inode - директория, устанавливаем разрешения с учётом umask
-    new_inode->uid = fuse_get_context()->uid;
-    new_inode->gid = fuse_get_context()->gid;
-    new_inode->num = new_num;
-    new_inode->par = pref_inode;
-    new_inode->update_time(1, 1, 1);  // устанвливаем время - при создании
-
-    ((catalog_data *) pref_inode->data)->add_file(dir, new_num);  // добавили в prefix директорию новую
-    pref_inode->update_time(0, 1, 1);  // в prefix-директории появился новый файл -> время изменено: mtim меняется, так как жанные директории изменены - новый файл, ctim меняется, так как меняется счётчик файлов...
-
+    int new_num = TMPFS_DATA->make_node(num, dir, (mode & ~fuse_get_context()->umask) | S_IFDIR, fuse_get_context()->uid, fuse_get_context()->gid);  // устанавливаем разрешения с учётом umask
+    TMPFS_DATA->changes.add("mkdir", new_num, num, _path);
+    overlay_op(WB_MKDIR, _path, TMPFS_DATA->inodes[new_num]);
     return 0;
 }
 
@@ -300,9 +1106,12 @@ int tmpfs_mkdir(const char *_path, mode_t mode) {
 // Функция создания файла (вызывается при touch, например):
 int tmpfs_mknod(const char *_path, mode_t mode, dev_t dev) {
     (void) dev;
+    cache_maintain();
 
-    if (get_num_inode_by_path(_path) >= 0)
+    if (get_num_inode_by_path(_path) >= 0 || is_changes(_path))
         return -EEXIST;
+    if (find_query(_path) != NULL)
+        return -EACCES;
 
     string prefix, file;
     get_prefix_and_name(_path, prefix, file);
@@ -315,30 +1124,21 @@ int tmpfs_mknod(const char *_path, mode_t mode, dev_t dev) {
     if (check_X_in_path(prefix.c_str()) == 0 || TMPFS_DATA->inodes[num]->check_mode(0, 1, 0) == 0)
         return -EACCES;  // в пути нет X-бита бита, нет права на запись в родительской директории
 
-    int new_num = TMPFS_DATA->new_inode();  // создали новую inode для файла file
-    INODE* new_inode = TMPFS_DATA->inodes[new_num];
-    INODE *pref_inode = TMPFS_DATA->inodes[num];  // prefix-директория, где файл создаётся
-
-    new_inode->data = new file_data();  // данные dir
-    new_inode->nlink = 1;  // изначально 1 ссылка - из prefix-директории
-    new_inode->mode = (mode & ~fuse_get_context()->umask) | S_IFREG;  // отмечаем, что данная inode - это регулярный файл
-    new_inode->uid = fuse_get_context()->uid;
-    new_inode->gid = fuse_get_context()->gid;
-    new_inode->num = new_num;
-    new_inode->par = pref_inode;
-    new_inode->update_time(1, 1, 1); 
-
-    ((catalog_data *) pref_inode->data)->add_file(file, new_num);  // добавили в текущую директорию новый файл
-    pref_inode->update_time(0, 1, 1);
-
+    int new_num = TMPFS_DATA->make_node(num, file, (mode & ~fuse_get_context()->umask) | S_IFREG, fuse_get_context()->uid, fuse_get_context()->gid);  // отмечаем, что данная inode - это регулярный файл
+    TMPFS_DATA->changes.add("create", new_num, num, _path);
+    overlay_op(WB_CREATE, _path, TMPFS_DATA->inodes[new_num]);
     return 0;
 }
 
 
 // Создаём жёсткую ссылку по пути _newpath на файл на _path:
 int tmpfs_link(const char *_path, const char *_newpath) {
-    if (get_num_inode_by_path(_newpath) >= 0)
+    if (get_num_inode_by_path(_newpath) >= 0 || is_changes(_newpath))
         return -EEXIST;
+    if (is_changes(_path))
+        return -EPERM;  // на журнал изменений ссылок не бывает
+    if (find_query(_path) != NULL || find_query(_newpath) != NULL)
+        return -EACCES;
 
     string prefix, file;
     get_prefix_and_name(_newpath, prefix, file);
@@ -359,7 +1159,10 @@ int tmpfs_link(const char *_path, const char *_newpath) {
     pref_inode->update_time(0, 1, 1);
 
     TMPFS_DATA->inodes[oldnum]->nlink += 1;  // увеличиваем число жёстких ссылок на файл
+    TMPFS_DATA->link_added(TMPFS_DATA->inodes[oldnum], pref_inode);
     TMPFS_DATA->inodes[oldnum]->update_time(0, 0, 1);  // метаданные изменили -> меняем время
+    TMPFS_DATA->changes.add("link", oldnum, num, _newpath);
+    overlay_op(WB_LINK, _path, NULL, _newpath);
 
     return 0;
 }
@@ -367,9 +1170,34 @@ int tmpfs_link(const char *_path, const char *_newpath) {
 
 // Функция получения информации (вызывается при ls -l, напрмимер):
 int tmpfs_getattr(const char *path, struct stat *statbuf) {
+    cache_maintain();
     if (path[0] == 0)
         return -ENOENT;  // возвращаем -errno: значение ENOENT (согласно man 2 stat) - значит, что путь path - пустая строка (то есть сразу идёт нулевой байт - символ конца строки)
 
+    if (is_changes(path)) {  // журнал изменений: читать и писать команды может только владелец корня, размер всегда 0 - файл читается как поток
+        statbuf->st_mode = S_IFREG | 0600;
+        statbuf->st_nlink = 1;
+        statbuf->st_uid = TMPFS_DATA->inodes[0]->uid;
+        statbuf->st_gid = TMPFS_DATA->inodes[0]->gid;
+        statbuf->st_atim = statbuf->st_mtim = statbuf->st_ctim = get_curr_timespec();
+        statbuf->st_size = 0;
+        return 0;
+    }
+    const char *query = find_query(path);
+    if (query != NULL && find_is_listing(query)) {  // директория поиска: только читать
+        statbuf->st_mode = S_IFDIR | 0555;
+        statbuf->st_nlink = 2;
+        statbuf->st_uid = TMPFS_DATA->inodes[0]->uid;
+        statbuf->st_gid = TMPFS_DATA->inodes[0]->gid;
+        statbuf->st_atim = statbuf->st_mtim = statbuf->st_ctim = get_curr_timespec();
+        statbuf->st_size = 0;
+        return 0;
+    }
+    if (query != NULL) {
+        string target = find_target(query);
+        return target.size() > 0 ? tmpfs_getattr(target.c_str(), statbuf) : -ENOENT;
+    }
+
     int num = get_num_inode_by_path(path);
     if (num == PATH_NOT_FOUND)
         return -ENOENT;  // некорректный путь
@@ -401,8 +1229,18 @@ int tmpfs_getattr(const char *path, struct stat *statbuf) {
 
 // Функция, которая открывает директорию:
 int tmpfs_opendir(const char *path, struct fuse_file_info *fi) {
+    cache_maintain();
     if (path[0] == 0)
         return -ENOENT;  // имя - пустая строка
+    const char *query = find_query(path);
+    if (query != NULL && find_is_listing(query)) {
+        fi->fh = (uint64_t) find_run(query);  // результаты считаем один раз при открытии - readdir только отдаёт их
+        return 0;
+    }
+    if (query != NULL) {
+        string target = find_target(query);
+        return target.size() > 0 ? tmpfs_opendir(target.c_str(), fi) : -ENOENT;
+    }
     
     int num = get_num_inode_by_path(path);
     if (num < 0)
@@ -415,6 +1253,8 @@ int tmpfs_opendir(const char *path, struct fuse_file_info *fi) {
     
     if (S_ISDIR(inode->mode) == 0)
         return -ENOTDIR;  // путь - не директория
+    if (inode->stub)
+        overlay_populate(inode);
     
     fi->fh = num;  // сохраняем в структуре inode номер открытой директории
     inode->opened_by += 1;
@@ -426,7 +1266,15 @@ int tmpfs_opendir(const char *path, struct fuse_file_info *fi) {
 // Функция, которая прочитывает директорию (при ls вызывается):
 int tmpfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
 	              struct fuse_file_info *fi) {
-    (void) path; (void) offset;
+    (void) offset;
+    const char *query = find_query(path);
+    if (query != NULL && find_is_listing(query)) {
+        filler(buf, ".", NULL, 0);
+        filler(buf, "..", NULL, 0);
+        for (const string &name: *(vector <string> *) fi->fh)
+            filler(buf, name.c_str(), NULL, 0);
+        return 0;
+    }
 
     int num = fi->fh;  // берём номер inode директории - его знаем по opendir
     INODE *inode = TMPFS_DATA->inodes[num];
@@ -437,7 +1285,7 @@ int tmpfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t off
         return -ENOTDIR;  // путь - не директория
 
     for (auto pairs: ((catalog_data *) inode->data)->files)
-        filler(buf, pairs.first.c_str(), NULL, 0);  // добавляем имеющийся файл в функцию
+        filler(buf, name_arena().str(pairs.first), NULL, 0);  // добавляем имеющийся файл в функцию
 
     inode->update_time(1, 0, 0);  // только лишь получаем доступ, метаданные не меняеются: opened_by - не метаданные, а внутренний счётчик... -> меняем только atim
 
@@ -447,7 +1295,11 @@ int tmpfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t off
 
 // Функция, которая закрывает директорию:
 int tmpfs_closedir(const char *path, struct fuse_file_info *fi) {
-    (void) path;
+    const char *query = find_query(path);
+    if (query != NULL && find_is_listing(query)) {
+        delete (vector <string> *) fi->fh;
+        return 0;
+    }
 
     int num = fi->fh;
     INODE *inode = TMPFS_DATA->inodes[num];
@@ -461,6 +1313,8 @@ int tmpfs_closedir(const char *path, struct fuse_file_info *fi) {
 int tmpfs_unlink(const char *path) {
     if (path[0] == 0)
         return -ENOENT;
+    if (is_changes(path))
+        return -EPERM;
     int num = get_num_inode_by_path(path);
     if (num == PATH_NOT_FOUND)
         return -ENOENT;  // некорректный путь
@@ -470,26 +1324,25 @@ int tmpfs_unlink(const char *path) {
     INODE *inode = TMPFS_DATA->inodes[num];
     if (S_ISDIR(inode->mode) == 1)
         return -EISDIR;  // путь - директория
-    if (check_X_in_path(path, 1) == 0 || inode->par->check_mode(0, 1, 0) == 0)
-        return -EACCES;  // нет права на исполнение в пути или нет права на запись в директории
 
-    string _, name;
-    get_prefix_and_name(path, _, name);
-
-    ((catalog_data *) inode->par->data)->delete_file(name);  // удаляем файл из родительского каталога
-    inode->nlink -= 1;  // удаляем файл = уменьшаем количетсво ссылок (так как "имя файла" в директории - тоже жёсткая ссылка) на него
-    inode->par->update_time(0, 1, 1);  // в родительском каталоге удалился файл -> обновляем время
-    inode->update_time(0, 0, 1);  // файл не читали, а лишь изменили метаданные - кол-во ссылок
+    string prefix, name;
+    get_prefix_and_name(path, prefix, name);
+    INODE *dir = TMPFS_DATA->inodes[get_num_inode_by_path(prefix.c_str())];  // у жёсткой ссылки это не обязательно par
+    if (check_X_in_path(path, 1) == 0 || dir->check_mode(0, 1, 0) == 0)
+        return -EACCES;  // нет права на исполнение в пути или нет права на запись в директории
 
-    if (inode->opened_by == 0 && inode->nlink == 0)  // если файл не открыт и на файл не ссылается -> очищаем память
-        TMPFS_DATA->delete_inode(num);
-    
+    TMPFS_DATA->changes.add("unlink", num, dir->num, path);
+    overlay_keep_data(inode);
+    overlay_op(WB_UNLINK, path, NULL);
+    unlink_entry(num, dir, name);
     return 0;
 }
 
 
 // Функция удаления директории:
 int tmpfs_rmdir(const char *path) {
+    if (is_changes(path))
+        return -ENOTDIR;
     int num = get_num_inode_by_path(path);
     if (num == PATH_NOT_FOUND)
         return -ENOENT;  // некорректный путь
@@ -502,6 +1355,8 @@ int tmpfs_rmdir(const char *path) {
     if (check_X_in_path(path, 1) == 0 || inode->par->check_mode(0, 1, 0) == 0)
         return -EACCES;
 
+    if (inode->stub)
+        overlay_populate(inode);  // пуста ли директория, знает только нижняя директория
     if (((catalog_data *) TMPFS_DATA->inodes[num]->data)->count > 2)  // если в директории ссылок > 2 (есть что-то кроме . и ..)
         return -ENOTEMPTY;  // не пустая директория
 
@@ -510,6 +1365,9 @@ int tmpfs_rmdir(const char *path) {
 
     ((catalog_data *) inode->par->data)->delete_file(name);
     inode->par->update_time(0, 1, 1);
+    TMPFS_DATA->tree_detach(inode);
+    TMPFS_DATA->changes.add("rmdir", num, inode->par->num, path);
+    overlay_op(WB_RMDIR, path, NULL);
     TMPFS_DATA->delete_inode(num);
 
     return 0;
@@ -525,6 +1383,10 @@ int tmpfs_rmdir(const char *path) {
 int tmpfs_rename(const char *oldpath, const char *newpath) {
     if (oldpath[0] == 0 || newpath[0] == 0)
         return -ENOENT;  // путь - пустая строка
+    if (is_changes(oldpath) || is_changes(newpath))
+        return -EPERM;  // журнал изменений не переименовывается и не перезаписывается
+    if (find_query(oldpath) != NULL || find_query(newpath) != NULL)
+        return -EACCES;
 
     int oldnum = get_num_inode_by_path(oldpath);
     if (oldnum == PATH_NOT_FOUND)
@@ -549,6 +1411,8 @@ int tmpfs_rename(const char *oldpath, const char *newpath) {
             return -EISDIR;  // newpath - директория, но oldpath - НЕ диреткория
         if (S_ISDIR(curr->mode) == 0 && S_ISDIR(inode->mode) == 1)
             return -ENOTDIR;  // тут наоборот
+        if (curr->stub && S_ISDIR(curr->mode) == 1)
+            overlay_populate(curr);
         if (S_ISDIR(curr->mode) == 1 && ((catalog_data *) curr->data)->count > 2)
             return -ENOTEMPTY;  // если newpath - существующая директория, но не пустая - те есть что-то кроме . и .., то тоже ошибка, чтобы не перезаписать существующую директорию!
                                 // с файлами вот такого нет... если файл newpath существует и даже не пустой, то никакой ошибки - просто перезаписывается
@@ -564,15 +1428,24 @@ int tmpfs_rename(const char *oldpath, const char *newpath) {
 
     rassert(newpref >= 0, "Странно, вроде уже проверяли существование");  // так как newpath уже проверили и на то, что кусочек пути - директория - это проверяли в newnum == PREFIX_IS_NOT_DIR, и на то, что prefix - существует - только что проверили, то теперь точно prefix - существующая директория
     INODE *prefdir = TMPFS_DATA->inodes[newpref];  // то, где должен быть переименованный файл name
+    string oldprefix, oldname;
+    get_prefix_and_name(oldpath, oldprefix, oldname);
+    INODE *olddir = TMPFS_DATA->inodes[get_num_inode_by_path(oldprefix.c_str())];  // откуда убираем имя: у жёсткой ссылки это не обязательно par
     if (check_X_in_path(oldpath, 1) == 0 || check_X_in_path(prefix.c_str(), 0) == 0 ||
-        TMPFS_DATA->inodes[newpref]->check_mode(0, 1, 0) == 0 || TMPFS_DATA->inodes[oldnum]->par->check_mode(0, 1, 0) == 0 ||
+        TMPFS_DATA->inodes[newpref]->check_mode(0, 1, 0) == 0 || olddir->check_mode(0, 1, 0) == 0 ||
         (S_ISDIR(TMPFS_DATA->inodes[oldnum]->mode) == 1 && TMPFS_DATA->inodes[oldnum]->check_mode(0, 1, 0) == 0))
         return -EACCES;  // нет X бита в путях ИЛИ нет права на запись в директориях ИЛИ переименуемая штука - директория, в которой нет права записи - нужно для обнолвения .. ссылки
 
     if (newnum >= 0) {  // если name уже существует и до этого не вызвал ошибок, значит мы его перезаписываем -> для начала просто удаляем
         INODE* curr = TMPFS_DATA->inodes[newnum];
-        ((catalog_data *) curr->par->data)->delete_file(name);  // удаляем запись о файле из prefix
+        overlay_keep_data(curr);  // пока путь к curr ещё есть
+        TMPFS_DATA->changes.add(S_ISDIR(curr->mode) == 1 ? "rmdir" : "unlink", newnum, newpref, newpath);  // перезаписанное имя исчезает до записи rename
+        ((catalog_data *) prefdir->data)->delete_file(name);  // удаляем запись о файле из prefix
         curr->nlink -= 1;  // удаляем файл = уменьшаем количетсво ссылок на него
+        TMPFS_DATA->relink(curr, prefdir);
+        if (S_ISDIR(curr->mode) == 1 || curr->nlink == 0)
+            TMPFS_DATA->tree_detach(curr);
+        overlay_forget(curr);
         if (S_ISDIR(curr->mode) == 1)
             TMPFS_DATA->delete_inode(newnum);  // если это директория, а мы знаем, что она пустая, то удаляем сразу
         if (S_ISREG(curr->mode) == 1 && curr->opened_by == 0 && curr->nlink == 0)  // если это файл и он не открыт и на него не ссылается -> тоже очищаем память
@@ -581,18 +1454,21 @@ int tmpfs_rename(const char *oldpath, const char *newpath) {
 
     ((catalog_data *) prefdir->data)->add_file(name, oldnum);  // теперь добавляем в директорию то, что переименовывали с новым именем
     
-    string _, oldname;
-    get_prefix_and_name(oldpath, _, oldname);
-    ((catalog_data *) inode->par->data)->delete_file(oldname);  // удаляем запись о файле из старой директории - так как файл переименовали
+    ((catalog_data *) olddir->data)->delete_file(oldname);  // удаляем запись о файле из старой директории - так как файл переименовали
+    TMPFS_DATA->link_moved(inode, olddir, prefdir);
+    TMPFS_DATA->changes.add("rename", oldnum, olddir->num, oldpath, 0, 0, newpref, newpath);
+    overlay_op(WB_RENAME, oldpath, NULL, newpath);
 
-    inode->par->update_time(0, 1, 1);  // обновили время в старой директории
+    olddir->update_time(0, 1, 1);  // обновили время в старой директории
     prefdir->update_time(0, 1, 1);  // обновили время в новой
     
+    TMPFS_DATA->tree_detach(inode);  // вместе с inode из старой директории в новую переезжают и её суммы (новое имя - в prefdir, поэтому и par - она)
     inode->par = prefdir;  // !!! Важно!!! не забыли обновить предка директории! до этого была ошибка после команд mkdir -p 1/2/3/4/5, mv 1/2/3 ., -> вроде в / две директории: 1 и 3, но удаление rm -r 3 давало ошибку!, так как par старый был
     if (S_ISDIR(inode->mode) == 1) {
         ((catalog_data *) inode->data)->delete_file("..");
         ((catalog_data *) inode->data)->add_file("..", newpref);  // обновляем .. в директории! - просто предабавляем
     }
+    TMPFS_DATA->tree_attach(inode);
     inode->update_time(0, 0, 1);
     return 0;
 }
@@ -600,6 +1476,19 @@ int tmpfs_rename(const char *oldpath, const char *newpath) {
 
 // Функция открытия файла:
 int tmpfs_open(const char *path, struct fuse_file_info *fi) {
+    cache_maintain();
+    if (is_changes(path)) {
+        if (!changes_allowed())
+            return -EACCES;
+        fi->fh = (uint64_t) TMPFS_DATA->changes.open_reader();  // у каждого открытия - своё место чтения и свой фильтр
+        fi->direct_io = 1;  // смещения не используем: каждое чтение отдаёт следующие записи
+        return 0;
+    }
+    const char *query = find_query(path);
+    if (query != NULL) {
+        string target = find_target(query);  // найденный путь открываем как настоящий файл: дальше работаем по fi->fh
+        return find_is_listing(query) ? -EISDIR : target.size() > 0 ? tmpfs_open(target.c_str(), fi) : -ENOENT;
+    }
     int num = get_num_inode_by_path(path);
     if (num == PREFIX_IS_NOT_DIR)
         return -ENOTDIR;
@@ -612,9 +1501,13 @@ int tmpfs_open(const char *path, struct fuse_file_info *fi) {
 
     if (S_ISDIR(inode->mode) == 1)
         return -EISDIR;  // путь на директорию!
+    int res = overlay_fill(inode);
+    if (res < 0)
+        return res;
     
     fi->fh = num;  // сохраняем в структуре
     inode->opened_by += 1;
+    TMPFS_DATA->lru_touch(inode);
     
     return 0;
 }
@@ -622,21 +1515,19 @@ int tmpfs_open(const char *path, struct fuse_file_info *fi) {
 
 // Функция чтения из файла (вызывается, когда, например, команда cat):
 int tmpfs_pread(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
-    (void) path;
+    if (is_changes(path))
+        return TMPFS_DATA->changes.read((change_reader *) fi->fh, buf, size);  // 0 - новых записей пока нет
 
     INODE* inode = TMPFS_DATA->inodes[fi->fh];
     file_data *data = (file_data *) inode->data;
     if (inode->check_mode(1, 0, 0) == 0)
         return -EACCES;
-    size_t ind = 0;
-    for (size_t i = offset; i < data->size; i ++) {  // читаем начиная с offset до конца файла
-        if (ind == size)  // если уже прочиали сколько нужно -> останавливаем
-            break;
-        buf[ind] = (char) data->data[i];
-        ind += 1;
-    }
+    ssize_t ind = data->read(buf, size, offset);  // читаем начиная с offset, но не дальше конца файла
+    if (ind < 0)
+        return ind;  // кусок не удалось прочитать из файла вытеснения
 
     inode->update_time(1, 0, 0);
+    TMPFS_DATA->lru_touch(inode);
 
     return ind;  // кол-во считанных байт
 }
@@ -644,23 +1535,27 @@ int tmpfs_pread(const char *path, char *buf, size_t size, off_t offset, struct f
 
 // Функция записи в файл (когда через nano редактируем, например):
 int tmpfs_pwrite(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
-    (void) path;
+    if (is_changes(path))
+        return TMPFS_DATA->changes.command((change_reader *) fi->fh, string_view(buf, size)) ? (int) size : -EINVAL;
 
     INODE* inode = TMPFS_DATA->inodes[fi->fh];
     file_data *data = (file_data *) inode->data;
     if (inode->check_mode(0, 1, 0) == 0)
         return -EACCES;
-    rassert(offset <= (off_t) data->size, "Пишем за концом файла!");
-
-    size_t ind = 0;
-    for (size_t i = offset; ; i ++) {
-        if (ind == size)
-            break;
-        data->add_byte(i, buf[ind]);
-        ind += 1;
-    }
+    size_t old_size = data->size;
+    ssize_t ind = data->write(buf, size, offset);  // если offset за концом файла, промежуток станет дырой из нулей
+    TMPFS_DATA->tree_resized(inode, old_size);
+    overlay_written(inode, old_size, offset, size);  // при ошибке часть байт уже могла записаться
+    if (ind < 0)
+        return ind;  // кусок не удалось прочитать из файла вытеснения
 
     inode->update_time(0, 1, 1);
+    const char *query = find_query(path);
+    string real_path = query != NULL ? find_target(query) : path != NULL ? path : "";  // открыт через результат поиска - пишем настоящий путь
+    TMPFS_DATA->changes.add_write(inode->num, parent_num(inode), real_path.c_str(), offset, ind);
+    TMPFS_DATA->lru_touch(inode);
+    cache_enforce_cap();  // сам файл открыт - его не вытесним
+    overlay_maintain();
 
     return ind;  // кол-во записанных байт
 }
@@ -668,7 +1563,8 @@ int tmpfs_pwrite(const char *path, const char *buf, size_t size, off_t offset, s
 
 // Закрываем файл:
 int tmpfs_close(const char *path, struct fuse_file_info *fi) {
-    (void) path;
+    if (is_changes(path))
+        return 0;  // читателя журнала удаляем в tmpfs_release
 
     int num = fi->fh;
     INODE *inode = TMPFS_DATA->inodes[num];
@@ -677,13 +1573,33 @@ int tmpfs_close(const char *path, struct fuse_file_info *fi) {
 
     if (inode->opened_by == 0 && inode->nlink == 0)  // если файл не открыт и ссылок нет (то есть ни в какой директории файла нет), удаляем!
         TMPFS_DATA->delete_inode(num);
+    else if (inode->opened_by == 0)
+        TMPFS_DATA->lru_touch(inode);  // закрытый файл снова можно вытеснить
+    if (inode->opened_by == 0 && inode->nlink > 0 && TMPFS_DATA->overlay != NULL)
+        overlay_flush(num);  // последнее закрытие: содержимое сразу отдаём потокам записи
 	
     return 0;
 }
 
 
+// Последнее закрытие открытого файла: нужно только журналу изменений - освобождаем состояние читателя
+// (для обычных файлов всё делает tmpfs_close):
+int tmpfs_release(const char *path, struct fuse_file_info *fi) {
+    if (is_changes(path))
+        delete (change_reader *) fi->fh;
+    return 0;
+}
+
+
 // Делаем файл строго размера = newsize:
 int tmpfs_truncate(const char *path, off_t newsize) {
+    if (is_changes(path))
+        return 0;  // open с O_TRUNC - журнал не меняется
+    const char *query = find_query(path);
+    if (query != NULL) {  // как open: открытие найденного файла с O_TRUNC приходит сюда раньше самого open
+        string target = find_target(query);
+        return find_is_listing(query) ? -EISDIR : target.size() > 0 ? tmpfs_truncate(target.c_str(), newsize) : -ENOENT;
+    }
     int num = get_num_inode_by_path(path);
     if (num == PREFIX_IS_NOT_DIR)
         return -ENOTDIR;
@@ -696,12 +1612,23 @@ int tmpfs_truncate(const char *path, off_t newsize) {
 
     if (S_ISDIR(inode->mode) == 1)
         return -EISDIR;
+    if (inode->stub && newsize == 0)
+        inode->stub = false;  // open с O_TRUNC: старое содержимое читать незачем
+    int res = overlay_fill(inode);
+    if (res < 0)
+        return res;
 
     file_data *data = (file_data *) inode->data;
-    data->data.resize(newsize);
-    data->size = newsize;
+    size_t old_size = data->size;
+    if (data->resize(newsize) == false)
+        return -EIO;  // последний кусок не удалось прочитать из файла вытеснения
+    TMPFS_DATA->tree_resized(inode, old_size);
+    overlay_written(inode, old_size, 0, 0);
 
     inode->update_time(0, 1, 1);
+    TMPFS_DATA->changes.add("truncate", num, parent_num(inode), path, newsize);
+    TMPFS_DATA->lru_touch(inode);
+    cache_enforce_cap();
 
     return 0;
 }
@@ -711,6 +1638,8 @@ int tmpfs_truncate(const char *path, off_t newsize) {
 int tmpfs_utimens(const char *path, const struct timespec *tv) {
     if (path[0] == 0)
         return -ENOENT;
+    if (is_changes(path))
+        return 0;  // времена журнала - всегда текущие
 
     int num = get_num_inode_by_path(path);
     if (num == PATH_NOT_FOUND)
@@ -725,11 +1654,14 @@ int tmpfs_utimens(const char *path, const struct timespec *tv) {
 
     if (tv == NULL) {  // см документацию utimensat(2)
         inode->st_atim = inode->st_mtim = get_curr_timespec();
+        TMPFS_DATA->changes.add("attrib", num, parent_num(inode), path);
+        overlay_op(WB_UTIMES, path, inode);
         return 0;
     }
 
     if (!(check_tv(tv[0]) && check_tv(tv[1])))
         return -EINVAL;  // некорректное временное значение
+    TMPFS_DATA->changes.add("attrib", num, parent_num(inode), path);
 
     if (tv[0].tv_nsec == UTIME_NOW) {  // устанавливаем ткущее время
         inode->st_atim = get_curr_timespec();
@@ -746,6 +1678,7 @@ int tmpfs_utimens(const char *path, const struct timespec *tv) {
     } else {
         inode->st_mtim = tv[1];
     }
+    overlay_op(WB_UTIMES, path, inode);
 
     return 0;
 }
@@ -753,6 +1686,8 @@ int tmpfs_utimens(const char *path, const struct timespec *tv) {
 
 // Функция для изменния прав доступа (при chmod вызывается)
 int tmpfs_chmod(const char *path, mode_t mode) {
+    if (is_changes(path))
+        return -EPERM;
     int num = get_num_inode_by_path(path);
     if (num == PATH_NOT_FOUND)
         return -ENOENT;
@@ -770,6 +1705,8 @@ int tmpfs_chmod(const char *path, mode_t mode) {
         inode->mode = mode | S_IFDIR;
     if (S_ISREG(inode->mode) == 1)
         inode->mode = mode |= S_IFREG;
+    TMPFS_DATA->changes.add("attrib", num, parent_num(inode), path);
+    overlay_op(WB_CHMOD, path, inode);
 
     return 0;
 }
@@ -777,6 +1714,8 @@ int tmpfs_chmod(const char *path, mode_t mode) {
 
 // Функция для изменения владельца:
 int tmpfs_chown(const char *path, uid_t uid, gid_t gid) {
+    if (is_changes(path))
+        return -EPERM;
     int num = get_num_inode_by_path(path);
     if (num == PATH_NOT_FOUND)
         return -ENOENT;
@@ -794,13 +1733,243 @@ int tmpfs_chown(const char *path, uid_t uid, gid_t gid) {
         inode->uid = uid;
     if (gid != (gid_t)-1)  // если значение не -1, то меняем пользвотеля
         inode->gid = gid;
+    TMPFS_DATA->changes.add("attrib", num, parent_num(inode), path);
+    overlay_op(WB_CHOWN, path, inode);
     return 0;
 }
 
 
+// Копируем len байт из файла num_in (со смещения off_in) в файл num_out (по смещению off_out) внутри ФС, не гоняя данные через ядро;
+// выровненные по CHUNK_SIZE куски не копируются, а разделяются между файлами до первой записи в них (copy-on-write).
+// FUSE 2 не умеет передавать нам copy_file_range, поэтому функция вызывается через setxattr (см. tmpfs_setxattr и tmcp.cpp)
+static ssize_t copy_file_range_by_num(int num_in, off_t off_in, int num_out, off_t off_out, size_t len) {
+    INODE *in = TMPFS_DATA->inodes[num_in];
+    INODE *out = TMPFS_DATA->inodes[num_out];
+    if (S_ISDIR(in->mode) == 1 || S_ISDIR(out->mode) == 1)
+        return -EISDIR;
+    if (off_in < 0 || off_out < 0)
+        return -EINVAL;
+    if (in->check_mode(1, 0, 0) == 0 || out->check_mode(0, 1, 0) == 0)
+        return -EACCES;
+    int res = overlay_fill(in);
+    if (res == 0)
+        res = overlay_fill(out);
+    if (res < 0)
+        return res;
+
+    size_t old_size = ((file_data *) out->data)->size;
+    ssize_t copied = ((file_data *) out->data)->copy_range((file_data *) in->data, off_in, off_out, len);
+    TMPFS_DATA->tree_resized(out, old_size);
+    overlay_written(out, old_size, off_out, copied < 0 ? len : copied);  // при ошибке часть байт уже могла скопироваться
+
+    in->update_time(1, 0, 0);
+    out->update_time(0, 1, 1);
+    TMPFS_DATA->lru_touch(in);
+    TMPFS_DATA->lru_touch(out);
+    cache_enforce_cap();
+    return copied;
+}
+
+
+// Устанавливаем расширенный атрибут; поддерживаются только служебные атрибуты:
+// setfattr -n user.tmpfs.copy_from -v /путь/к/источнику файл -> файл становится копией источника (путь - внутри нашей ФС)
+// setfattr -n user.tmpfs.copy_range -v "СМЕЩЕНИЕ_ИСТОЧНИКА СМЕЩЕНИЕ ДЛИНА /путь/к/источнику" файл -> как copy_file_range(2):
+//     копируем до ДЛИНА байт источника (не дальше его конца) в файл по СМЕЩЕНИЕ, остальное содержимое файла не трогаем
+// setfattr -n user.tmpfs.ttl -v 3600 файл -> файл будет удалён через час (0 - отменяем удаление)
+int tmpfs_setxattr(const char *path, const char *name, const char *value, size_t size, int flags) {
+    (void) flags;
+    if (is_changes(path))
+        return -EPERM;
+
+    int num = get_num_inode_by_path(path);
+    if (num == PATH_NOT_FOUND)
+        return -ENOENT;
+    if (num == PREFIX_IS_NOT_DIR)
+        return -ENOTDIR;
+    if (check_X_in_path(path, 1) == 0)
+        return -EACCES;
+
+    INODE *inode = TMPFS_DATA->inodes[num];
+    if (strcmp(name, "user.tmpfs.ttl") == 0) {
+        string ttl(value, size);
+        char *end;
+        long secs = strtol(ttl.c_str(), &end, 10);
+        if (S_ISREG(inode->mode) == 0 || ttl.size() == 0 || *end != 0 || secs < 0)
+            return -EINVAL;  // срок жизни бывает только у файлов и задаётся числом секунд
+        if (inode->check_mode(0, 1, 0) == 0)
+            return -EACCES;
+        TMPFS_DATA->set_ttl(inode, secs);
+        inode->update_time(0, 0, 1);
+        TMPFS_DATA->changes.add("attrib", num, parent_num(inode), path);
+        return 0;
+    }
+
+    if (strcmp(name, "user.tmpfs.copy_range") == 0) {
+        string arg(value, size);
+        long long off_in, off_out;
+        unsigned long long len;
+        int pos = 0;
+        if (sscanf(arg.c_str(), "%lld %lld %llu %n", &off_in, &off_out, &len, &pos) != 3 || pos == 0 || arg[pos] != '/')
+            return -EINVAL;  // путь источника - последним: в нём могут быть пробелы
+        if (off_in < 0 || off_out < 0 || len > (unsigned long long) SSIZE_MAX)
+            return -EINVAL;
+        const char *src_path = arg.c_str() + pos;
+        int src = get_num_inode_by_path(src_path);
+        if (src == PATH_NOT_FOUND)
+            return -ENOENT;
+        if (src == PREFIX_IS_NOT_DIR)
+            return -ENOTDIR;
+        if (check_X_in_path(src_path, 1) == 0)
+            return -EACCES;
+        ssize_t res = copy_file_range_by_num(src, off_in, num, off_out, len);
+        if (res > 0)
+            TMPFS_DATA->changes.add_write(num, parent_num(inode), path, off_out, res);
+        return res < 0 ? res : 0;
+    }
+
+    if (strcmp(name, "user.tmpfs.copy_from") != 0)
+        return -ENOTSUP;  // произвольные расширенные атрибуты не храним
+
+    string src_path(value, size);  // значение атрибута - не обязательно строка с нулём на конце
+    int src = get_num_inode_by_path(src_path.c_str());
+    if (src == PATH_NOT_FOUND)
+        return -ENOENT;
+    if (src == PREFIX_IS_NOT_DIR)
+        return -ENOTDIR;
+    if (check_X_in_path(src_path.c_str(), 1) == 0)
+        return -EACCES;
+    if (src == num)
+        return 0;  // копируем файл сам в себя - ничего не делаем
+
+    INODE *in = TMPFS_DATA->inodes[src];
+    INODE *out = TMPFS_DATA->inodes[num];
+    if (S_ISDIR(in->mode) == 1 || S_ISDIR(out->mode) == 1)
+        return -EISDIR;
+    if (in->check_mode(1, 0, 0) == 0 || out->check_mode(0, 1, 0) == 0)
+        return -EACCES;
+
+    int filled = overlay_fill(in);
+    if (filled < 0)
+        return filled;
+    out->stub = false;  // старое содержимое читать незачем
+
+    size_t old_size = ((file_data *) out->data)->size;
+    ((file_data *) out->data)->resize(0);  // копия целиком заменяет старое содержимое
+    TMPFS_DATA->tree_resized(out, old_size);
+    overlay_written(out, old_size, 0, 0);
+    TMPFS_DATA->changes.add("truncate", num, parent_num(out), path, 0);
+    ssize_t res = copy_file_range_by_num(src, 0, num, 0, ((file_data *) in->data)->size);
+    if (res > 0)
+        TMPFS_DATA->changes.add_write(num, parent_num(out), path, 0, res);
+    return res < 0 ? res : 0;
+}
+
+
+// Получаем расширенный атрибут; поддерживаются только служебные атрибуты:
+// getfattr -n user.tmpfs.spill mnt -> статистика памяти и вытеснения
+// getfattr -n user.tmpfs.cache mnt -> статистика режима кэша
+// getfattr -n user.tmpfs.ttl файл -> сколько секунд файлу осталось жить
+// getfattr -n user.tmpfs.subtree директория -> сколько байт, файлов и директорий во всём её поддереве
+// getfattr -n user.tmpfs.crc32c файл -> CRC32C содержимого файла (8 шестнадцатеричных цифр)
+// getfattr -n user.tmpfs.scrub mnt -> статистика фоновой проверки данных
+// getfattr -n user.tmpfs.writeback mnt -> статистика записи в нижнюю директорию (режим backing)
+int tmpfs_getxattr(const char *path, const char *name, char *value, size_t size) {
+    if (is_changes(path))
+        return -ENODATA;
+    int num = get_num_inode_by_path(path);
+    if (num == PATH_NOT_FOUND)
+        return -ENOENT;
+    if (num == PREFIX_IS_NOT_DIR)
+        return -ENOTDIR;
+    if (check_X_in_path(path, 1) == 0)
+        return -EACCES;
+
+    TableInodes *table = TMPFS_DATA;
+    INODE *inode = table->inodes[num];
+    string res;
+    if (strcmp(name, "user.tmpfs.spill") == 0) {
+        res = table->store.stats();
+    } else if (strcmp(name, "user.tmpfs.cache") == 0) {
+        res = "used_bytes=" + to_string(table->store.stored) +
+              " cap_bytes=" + to_string(table->cache_cap) +
+              " default_ttl=" + to_string(table->default_ttl) +
+              " expired=" + to_string(table->expired) +
+              " expire_deferred=" + to_string(table->expire_deferred) +
+              " evicted=" + to_string(table->evicted) + "\n";
+    } else if (strcmp(name, "user.tmpfs.crc32c") == 0 && S_ISREG(inode->mode) == 1) {
+        if (inode->check_mode(1, 0, 0) == 0)
+            return -EACCES;  // сумма раскрывает содержимое
+        int filled = overlay_fill(inode);
+        if (filled < 0)
+            return filled;
+        uint32_t crc;
+        if (((file_data *) inode->data)->checksum(crc) == false)
+            return -EIO;  // данные файла повреждены
+        char hex[16];
+        snprintf(hex, sizeof(hex), "%08x", crc);
+        res = hex;
+    } else if (strcmp(name, "user.tmpfs.scrub") == 0) {
+        res = table->store.scrub_stats();
+    } else if (strcmp(name, "user.tmpfs.writeback") == 0 && table->overlay != NULL) {
+        table->overlay_reap();
+        res = table->overlay->stats();
+    } else if (strcmp(name, "user.tmpfs.subtree") == 0 && S_ISDIR(inode->mode) == 1) {
+        res = table->tree_totals(inode).str();
+    } else if (strcmp(name, "user.tmpfs.ttl") == 0 && inode->expire_at != 0) {
+        res = to_string(max(inode->expire_at - time(NULL), (time_t) 0));
+    } else {
+        return -ENODATA;  // других атрибутов у нас нет
+    }
+
+    if (size == 0)
+        return res.size();  // у нас спрашивают только размер значения
+    if (size < res.size())
+        return -ERANGE;
+    memcpy(value, res.data(), res.size());
+    return res.size();
+}
+
+
+// fsync файла: в режиме backing ждём, пока его содержимое (и всё, что изменилось в пространстве имён до этого) попадёт
+// в нижнюю директорию; без нижней директории данным некуда уходить - сразу успех
+int tmpfs_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+    (void) datasync;
+    if (is_changes(path))
+        return 0;
+    return overlay_sync(fi->fh);
+}
+
+
+// fsync директории: ждём, пока в нижнюю директорию попадут все изменения
+int tmpfs_fsyncdir(const char *path, int datasync, struct fuse_file_info *fi) {
+    (void) path;
+    (void) datasync;
+    (void) fi;
+    return overlay_sync(-1);
+}
+
+
+// Вызывается, когда ФС уже смонтирована - в том процессе, который будет обслуживать запросы (fuse_main к этому моменту
+// уже ушёл в фон через fork, а потоки fork не переживают), поэтому фоновые потоки запускаем здесь, а не в main:
+void *tmpfs_init(struct fuse_conn_info *conn) {
+    (void) conn;
+    TMPFS_DATA->store.start_threads();
+    if (TMPFS_DATA->overlay != NULL)
+        TMPFS_DATA->overlay->wb.start();
+    return TMPFS_DATA;  // private_data оставляем тем же
+}
+
+
+static bool shm_save(TableInodes *table);
+
 // Функция удаляем пользовательские данные - которые в fuse_getcontext()->private_data были
 void tmpfs_destroy(void *userdata) {
-    delete ((TableInodes *) userdata);
+    TableInodes *table = (TableInodes *) userdata;
+    if (table->overlay != NULL && (overlay_sync(-1) < 0 || table->overlay->dirty_files() > 0))
+        fprintf(stderr, "Не все изменения удалось записать в нижнюю директорию\n");
+    if (table->shm_name != NULL && shm_save(table) == false)
+        perror("Не удалось сохранить описание ФС в разделяемой памяти - следующий запуск начнётся с пустой ФС");
+    delete table;  // после shm_save буферы в разделяемой памяти не освобождаются
 }
 
 
@@ -825,16 +1994,18 @@ struct fuse_operations tmpfs_oper = {
   .write = tmpfs_pwrite,
   .statfs = NULL,
   .flush = tmpfs_close,
-  .release = NULL,
-  .fsync = NULL,
+  .release = tmpfs_release,
+  .fsync = tmpfs_fsync,
+  .setxattr = tmpfs_setxattr,
+  .getxattr = tmpfs_getxattr,
   
   .opendir = tmpfs_opendir,
   .readdir = tmpfs_readdir,
   .releasedir = tmpfs_closedir,
-  .fsyncdir = NULL,
-  .init = NULL,  // эта функция вызывается в самом начале - перед монированием нашей ФС - и должна возвращать то, что потом попадёт в fuse_getcontext()->private_data
-                 // (данные, которые мы можем вытащить в любом месте программы - у нас такие данные - это tmpfs_data - указатель на TableInode, мы используем эти данные, чтобы добавлять/удалять inode)
-                 // - но мы и так заполяем private_data, когда вызываем fuse_main, поэтому в init нет необходимости... хотя её можно вызвать и она перезапишет эти данные на те, которые тут вернутся
+  .fsyncdir = tmpfs_fsyncdir,
+  .init = tmpfs_init,  // эта функция вызывается в самом начале - при монтировании нашей ФС - и должна возвращать то, что потом попадёт в fuse_getcontext()->private_data
+                      // (данные, которые мы можем вытащить в любом месте программы - у нас такие данные - это tmpfs_data - указатель на TableInode, мы используем эти данные, чтобы добавлять/удалять inode)
+                      // - private_data мы и так заполняем, когда вызываем fuse_main, поэтому возвращаем те же данные; а нужна она, чтобы запустить фоновые потоки
   .destroy = tmpfs_destroy,  // эта функция вызываеся в самом конце и очищает данные
   .access = NULL,
   .ftruncate = NULL,
@@ -847,6 +2018,504 @@ struct fuse_operations tmpfs_oper = {
   // flag_utime_omit_ok = 1 - принимаем значения UTIME _NOW и _OMIT
 };
 
+// === Импорт дерева при запуске (до fuse_main, поэтому без fuse_get_context) ===
+
+// Ищем в директории dir запись name; возвращаем номер inode или PATH_NOT_FOUND
+static int lookup_in(TableInodes *table, int dir, const string &name) {
+    return ((catalog_data *) table->inodes[dir]->data)->find(name);
+}
+
+
+// Разбиваем путь из архива на компоненты, выбрасывая "."
+static vector <string> import_parts(const string &path) {
+    vector <string> parts;
+    path_tokens tokens(path.c_str());
+    string_view token;
+    while (tokens.next(token))
+        if (token != ".")
+            parts.push_back(string(token));
+    return parts;
+}
+
+
+// Проходим первые count компонент пути от корня, создавая недостающие директории (как mkdir -p)
+static int import_dir(TableInodes *table, const vector <string> &parts, size_t count) {
+    int num = 0;
+    for (size_t i = 0; i < count; i ++) {
+        int next = lookup_in(table, num, parts[i]);
+        if (next == PATH_NOT_FOUND)
+            next = table->make_node(num, parts[i], 0755 | S_IFDIR, getuid(), getgid());
+        if (S_ISDIR(table->inodes[next]->mode) == 0)
+            return PREFIX_IS_NOT_DIR;
+        num = next;
+    }
+    return num;
+}
+
+
+static void import_attrs(INODE *inode, const import_entry *entry) {
+    inode->mode = (inode->mode & S_IFMT) | entry->mode;
+    inode->uid = entry->uid;
+    inode->gid = entry->gid;
+    inode->st_atim = entry->atim;
+    inode->st_mtim = entry->mtim;
+}
+
+
+// Создаём в ФС то, что описывает запись импорта; содержимое файла, которое придёт позже, запоминаем в pending
+static void import_apply(TableInodes *table, import_entry *entry, map <size_t, file_data*> &pending, vector <pair <int, import_entry>> &dirs) {
+    vector <string> parts = import_parts(entry->path);
+    if (parts.size() == 0)
+        return;  // сам корень - его права не трогаем
+    int par = import_dir(table, parts, parts.size() - 1);
+    if (par < 0) {
+        fprintf(stderr, "Импорт: пропускаем %s - часть пути не является директорией\n", entry->path.c_str());
+        return;
+    }
+    string name = parts.back();
+    int num = lookup_in(table, par, name);
+
+    if (entry->type == IMPORT_DIR) {
+        if (num == PATH_NOT_FOUND)
+            num = table->make_node(par, name, S_IFDIR, 0, 0);
+        if (S_ISDIR(table->inodes[num]->mode) == 0) {
+            fprintf(stderr, "Импорт: пропускаем директорию %s - такой файл уже есть\n", entry->path.c_str());
+            return;
+        }
+        import_attrs(table->inodes[num], entry);
+        dirs.push_back({num, *entry});  // времена директории выставим в самом конце: создание содержимого их меняет
+        return;
+    }
+
+    if (entry->type == IMPORT_HARDLINK) {
+        vector <string> link_parts = import_parts(entry->link);
+        int target = link_parts.size() > 0 ? import_dir(table, link_parts, link_parts.size() - 1) : PATH_NOT_FOUND;
+        if (target >= 0)
+            target = lookup_in(table, target, link_parts.back());
+        if (num != PATH_NOT_FOUND || target < 0 || S_ISREG(table->inodes[target]->mode) == 0) {
+            fprintf(stderr, "Импорт: не удалось создать жёсткую ссылку %s -> %s\n", entry->path.c_str(), entry->link.c_str());
+            return;
+        }
+        ((catalog_data *) table->inodes[par]->data)->add_file(name, target);
+        table->inodes[target]->nlink += 1;
+        table->link_added(table->inodes[target], table->inodes[par]);
+        return;
+    }
+
+    if (num != PATH_NOT_FOUND) {  // в архиве файл встретился повторно - как и tar, оставляем последнюю версию
+        INODE *old = table->inodes[num];
+        if (S_ISREG(old->mode) == 0) {
+            fprintf(stderr, "Импорт: пропускаем файл %s - такая директория уже есть\n", entry->path.c_str());
+            return;
+        }
+        ((catalog_data *) table->inodes[par]->data)->delete_file(name);
+        old->nlink -= 1;
+        table->relink(old, table->inodes[par]);
+        if (old->nlink == 0)
+            table->delete_inode(num);
+    }
+    num = table->make_node(par, name, S_IFREG, 0, 0);
+    import_attrs(table->inodes[num], entry);
+    file_data *data = (file_data *) table->inodes[num]->data;
+    if (entry->id != 0) {
+        pending[entry->id] = data;
+    } else {
+        data->adopt(entry->bufs, entry->size);
+        entry->bufs.clear();
+    }
+}
+
+
+// Заполняем ФС содержимым директории хоста или tar-архива (файл или "-" - стандартный ввод):
+// потоки чтения кладут записи в очередь, а мы здесь по порядку строим из них дерево
+static bool import_tree(TableInodes *table, const char *source) {
+    ImportQueue queue(&table->store.pool);
+    DirImporter *dir_importer = NULL;
+    TarImporter *tar_importer = NULL;
+    int fd = -1;
+
+    struct stat st;
+    if (strcmp(source, "-") == 0) {
+        fd = 0;
+    } else if (stat(source, &st) == 0 && S_ISDIR(st.st_mode)) {
+        dir_importer = new DirImporter(&queue, source);
+    } else {
+        fd = open(source, O_RDONLY);
+        if (fd < 0) {
+            perror(source);
+            return false;
+        }
+    }
+    if (dir_importer != NULL) {
+        dir_importer->start();
+    } else {
+        tar_importer = new TarImporter(&queue, fd);
+        tar_importer->start();
+    }
+
+    map <size_t, file_data*> pending;  // файлы, чьё содержимое ещё читается: id -> данные
+    vector <pair <int, import_entry>> dirs;  // директории и их атрибуты
+    size_t entries = 0, bytes = 0;
+    import_entry *entry;
+    while ((entry = queue.pop()) != NULL) {
+        if (entry->type == IMPORT_CONTENT || (entry->type == IMPORT_FILE && entry->id == 0))
+            bytes += entry->size;  // содержимое приходит либо вместе с файлом, либо отдельной записью
+        if (entry->type != IMPORT_CONTENT)
+            entries += 1;
+        if (entry->type == IMPORT_CONTENT) {
+            auto it = pending.find(entry->id);
+            if (it != pending.end()) {  // файл мог быть пропущен - тогда содержимое просто выбрасываем
+                it->second->adopt(entry->bufs, entry->size);
+                pending.erase(it);
+                entry->bufs.clear();
+            }
+        } else {
+            import_apply(table, entry, pending, dirs);
+        }
+
+        drop_entry(&table->store.pool, entry);
+    }
+
+    for (auto &dir: dirs)
+        import_attrs(table->inodes[dir.first], &dir.second);
+    table->tree_rebuild();  // содержимое файлов приходило отдельно от их inode - суммы проще посчитать один раз в конце
+
+    bool ok = true;
+    if (dir_importer != NULL) {
+        dir_importer->join();
+        ok = dir_importer->ok;
+        delete dir_importer;
+    } else {
+        tar_importer->join();
+        ok = tar_importer->ok;
+        delete tar_importer;
+        if (fd > 0)
+            close(fd);
+    }
+    fprintf(stderr, "Импорт %s: %zu записей, %zu байт\n", source, entries, bytes);
+    return ok;
+}
+
+
+// === Перезапуск без потери данных: -o shm=ИМЯ ===
+// Буферы кусков берутся из объекта разделяемой памяти /ИМЯ (см. BufferPool::attach_shm), поэтому байты файлов переживают процесс.
+// При размонтировании (tmpfs_destroy) в объект /ИМЯ.meta пишется описание ФС - inode, записи директорий и смещения кусков;
+// новый процесс с тем же ключом отображает данные обратно (без копирования) и строит по описанию те же inode с теми же номерами.
+// Описание удаляется сразу после чтения: если процесс упадёт, не успев записать новое, следующий запуск начнёт с пустой ФС,
+// а не с описания, которое уже не соответствует байтам.
+
+static bool shm_save(TableInodes *table) {
+    ChunkStore &store = table->store;
+    unordered_map <chunk*, uint64_t> ids;  // кусок -> номер в описании (разделяемые куски пишем один раз)
+    vector <chunk*> chunks;
+    size_t count = 0;  // сколько inode попадёт в описание
+    for (size_t i = 0; i < table->N; i ++) {
+        INODE *inode = table->inodes[i];
+        if (inode->mode == 0 || (S_ISREG(inode->mode) == 1 && inode->nlink == 0))
+            continue;  // удалённый, но ещё открытый файл после размонтирования никому не нужен
+        count += 1;
+        if (S_ISDIR(inode->mode) == 1)
+            continue;
+        for (chunk *c: ((file_data *) inode->data)->chunks) {
+            if (c != NULL && ids.count(c) == 0) {
+                if (store.data(c, false) == NULL) {  // вытесненный кусок возвращаем в разделяемую память
+                    errno = EIO;
+                    return false;
+                }
+                ids[c] = chunks.size();
+                chunks.push_back(c);
+            }
+        }
+    }
+
+    string meta = shm_object(table->shm_name, SNAPSHOT_META_SUFFIX);
+    int fd = shm_open(meta.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+    FILE *f = fd >= 0 ? fdopen(fd, "w") : NULL;
+    snapshot_writer out(f);
+    out.u64(SNAPSHOT_MAGIC);
+    out.u64(CHUNK_SIZE);
+    out.u64(POOL_REGION_BUFFERS);
+    out.u64(table->N);
+    out.u64(chunks.size());
+    out.u64(count);
+    for (chunk *c: chunks) {
+        out.u64(store.pool.shm_offset(c->bytes));
+        out.u64(c->cap);
+        out.u64(c->crc);
+        out.u64((c->crc_valid ? 1 : 0) | (c->corrupt ? 2 : 0));
+    }
+    for (size_t i = 0; i < table->N && out.ok; i ++) {
+        INODE *inode = table->inodes[i];
+        if (inode->mode == 0 || (S_ISREG(inode->mode) == 1 && inode->nlink == 0))
+            continue;
+        out.u64(inode->num);
+        out.u64(inode->mode);
+        out.u64(inode->nlink);
+        out.u64(inode->uid);
+        out.u64(inode->gid);
+        out.u64(inode->par != NULL ? inode->par->num : SNAPSHOT_NO_NUM);
+        out.u64(inode->expire_at);
+        bool unflushed = table->overlay != NULL && table->overlay->files.count(inode->num) > 0 &&
+                         table->overlay->files[inode->num].dirty();  // запись в нижнюю директорию не удалась
+        pair <dev_t, ino_t> *link = NULL;  // ключ жёсткой ссылки нижней директории, см. overlay_populate
+        if (table->overlay != NULL && table->overlay->link_keys.count(inode->num) > 0)
+            link = &table->overlay->link_keys[inode->num];
+        out.u64((inode->stub ? 1 : 0) | (unflushed ? 2 : 0) | (link != NULL ? 4 : 0));
+        if (link != NULL) {
+            out.u64(link->first);
+            out.u64(link->second);
+        }
+        out.time(inode->st_atim);
+        out.time(inode->st_mtim);
+        out.time(inode->st_ctim);
+        if (S_ISDIR(inode->mode) == 1) {
+            catalog_data *data = (catalog_data *) inode->data;
+            out.u64(data->count - 2);  // . и .. новый процесс добавит сам
+            for (auto &entry: data->files) {
+                string_view name = name_arena().view(entry.first);
+                if (NameIndex::is_dot(name))
+                    continue;
+                out.str(name);
+                out.u64(entry.second);
+            }
+        } else {
+            file_data *data = (file_data *) inode->data;
+            out.u64(data->size);
+            out.u64(data->chunks.size());
+            for (chunk *c: data->chunks)
+                out.u64(c != NULL ? ids[c] : SNAPSHOT_NO_NUM);
+        }
+    }
+    out.u64(SNAPSHOT_END);
+
+    bool ok = out.ok;
+    if (f != NULL)
+        ok = fclose(f) == 0 && ok;
+    else if (fd >= 0)
+        close(fd);
+    if (ok == false) {
+        shm_unlink(meta.c_str());
+        return false;
+    }
+    store.pool.detach();  // байты кусков остаются в разделяемой памяти для следующего процесса
+    fprintf(stderr, "Описание ФС сохранено в %s: %zu inode, %zu кусков\n", meta.c_str(), count, chunks.size());
+    return true;
+}
+
+
+// Строим ФС по описанию (таблица только что создана: в ней один корень, данные уже подключены через attach_shm).
+// Описание могли испортить, поэтому все номера и смещения проверяем; false - описанию верить нельзя
+static bool shm_load(TableInodes *table, FILE *f) {
+    snapshot_reader in(f);
+    ChunkStore &store = table->store;
+    if (in.u64() != SNAPSHOT_MAGIC || in.u64() != CHUNK_SIZE || in.u64() != POOL_REGION_BUFFERS)
+        return false;
+    uint64_t n = in.u64(), chunk_count = in.u64(), count = in.u64();
+    if (in.ok == false || n > INT32_MAX || count > n || chunk_count > store.pool.regions.size() * POOL_REGION_SIZE / CHUNK_MIN_CAP)
+        return false;
+    while (table->N < n)
+        table->resize();
+
+    vector <chunk*> chunks;
+    vector <dead_buffer> used;
+    for (uint64_t i = 0; i < chunk_count; i ++) {
+        uint64_t off = in.u64(), cap = in.u64(), crc = in.u64(), flags = in.u64();
+        uint8_t *bytes = in.ok ? store.pool.shm_buffer(off, cap) : NULL;
+        if (bytes == NULL)
+            return false;
+        chunk *c = store.adopt(bytes, cap);
+        c->refs = 0;  // ссылки добавятся вместе с файлами
+        c->crc = crc;
+        c->crc_valid = (flags & 1) != 0;
+        c->corrupt = (flags & 2) != 0;
+        chunks.push_back(c);
+        used.push_back({bytes, cap});
+    }
+    if (store.pool.adopt_shm(used) == false)
+        return false;
+
+    vector <pair <int, int>> children;  // записи директорий (директория, на кого ссылается) - проверим в конце
+    bool root_seen = false;
+    for (uint64_t k = 0; k < count && in.ok; k ++) {
+        int num = in.index(n);
+        INODE *inode = table->inodes[num];
+        mode_t mode = in.u64();
+        if ((num == 0 ? root_seen : inode->mode != 0) || (S_ISDIR(mode) == 0 && (S_ISREG(mode) == 0 || num == 0)))
+            return false;  // inode встретилась дважды, корень - не директория или тип неизвестен
+        root_seen = root_seen || num == 0;
+        inode->num = num;
+        inode->mode = mode;
+        inode->nlink = in.u64();
+        inode->uid = in.u64();
+        inode->gid = in.u64();
+        uint64_t par = in.u64();
+        if ((num == 0) != (par == SNAPSHOT_NO_NUM) || (num != 0 && par >= n))
+            return false;
+        inode->par = num != 0 ? table->inodes[par] : NULL;
+        inode->expire_at = in.u64();
+        uint64_t flags = in.u64();
+        inode->stub = (flags & 1) != 0;
+        if (flags != 0 && table->overlay == NULL)
+            return false;  // содержимое заглушки есть только в нижней директории, а незаписанное - некуда записывать
+        if ((flags & 4) != 0) {
+            uint64_t dev = in.u64(), ino = in.u64();
+            table->overlay->add_link(num, dev, ino);
+        }
+        inode->st_atim = in.time();
+        inode->st_mtim = in.time();
+        inode->st_ctim = in.time();
+
+        if (S_ISDIR(mode) == 1) {
+            if (num != 0) {
+                catalog_data *data = new catalog_data(num);
+                data->add_file(".", num);
+                data->add_file("..", par);
+                inode->data = data;
+            }
+            catalog_data *data = (catalog_data *) inode->data;
+            uint64_t entries = in.u64();
+            for (uint64_t i = 0; i < entries && in.ok; i ++) {
+                string name = in.str(NAME_MAX);
+                int child = in.index(n);
+                if (in.ok == false || name.size() == 0 || name.find('/') != string::npos || NameIndex::is_dot(name) || data->find(name) != PATH_NOT_FOUND)
+                    return false;
+                data->add_file(name, child);
+                children.push_back({num, child});
+            }
+        } else {
+            file_data *data = new file_data(&store);
+            inode->data = data;
+            data->size = in.u64();
+            uint64_t chunk_num = in.u64();
+            if (in.ok == false || chunk_num != (data->size + CHUNK_SIZE - 1) / CHUNK_SIZE)
+                return false;
+            for (uint64_t i = 0; i < chunk_num && in.ok; i ++) {
+                uint64_t id = in.u64();
+                if (id != SNAPSHOT_NO_NUM && id >= chunk_count)
+                    return false;
+                chunk *c = id != SNAPSHOT_NO_NUM ? chunks[id] : NULL;
+                if (c != NULL)
+                    c->refs += 1;
+                data->chunks.push_back(c);
+            }
+            if ((flags & 2) != 0) {  // прошлый процесс не смог записать файл в нижнюю директорию - запишем его целиком
+                wb_file &file = table->overlay->files[num];
+                file.serial = table->overlay->next_serial ++;
+                file.min_size = data->size;
+                file.resized = true;
+                for (size_t i = 0; i < data->chunks.size(); i ++)
+                    file.chunks.insert(i);
+            }
+            table->lru_touch(inode);
+            if (inode->expire_at != 0)
+                table->wheel.add(num, inode->expire_at);
+        }
+    }
+    if (in.ok == false || root_seen == false || in.u64() != SNAPSHOT_END)
+        return false;
+
+    // par файла - любая директория, где есть его имя (записанная par - если имя в ней есть); директория лежит ровно в своей par
+    vector <int> holder(n, -1);
+    for (auto &entry: children) {
+        if (table->inodes[entry.second]->mode == 0)
+            return false;
+        if (holder[entry.second] == -1 || table->inodes[entry.second]->par == table->inodes[entry.first])
+            holder[entry.second] = entry.first;
+    }
+    for (size_t i = 1; i < n; i ++) {
+        INODE *inode = table->inodes[i];
+        if (inode->mode == 0)
+            continue;
+        if (holder[i] == -1 || (S_ISDIR(inode->mode) == 1 && inode->par != table->inodes[holder[i]]))
+            return false;  // ни в одной директории нет имени inode или у директории неверная ".."
+        inode->par = table->inodes[holder[i]];
+    }
+    vector <uint32_t> names(n, 0);
+    for (auto &entry: children)
+        names[entry.second] += 1;
+    for (auto &entry: children) {  // директории с именами файлов, у которых имён несколько
+        INODE *inode = table->inodes[entry.second];
+        if (S_ISREG(inode->mode) == 1 && names[entry.second] > 1) {
+            if (inode->links == NULL)
+                inode->links = new vector <int>;
+            inode->links->push_back(entry.first);
+        }
+    }
+    for (chunk *c: chunks)
+        if (c->refs == 0)
+            return false;
+
+    table->free_inodes.clear();
+    for (size_t i = 1; i < table->N; i ++)
+        if (table->inodes[i]->mode == 0)
+            table->free_inodes.push_back(i);
+    table->tree_rebuild();
+    return true;
+}
+
+
+// Подключаем разделяемую память name; если есть описание от прошлого процесса - восстанавливаем по нему ФС
+static bool shm_restore(TableInodes *table, const char *name) {
+    string meta = shm_object(name, SNAPSHOT_META_SUFFIX);
+    int fd = shm_open(meta.c_str(), O_RDONLY, 0);  // без описания старые байты не нужны - их выбросит attach_shm
+    if (strchr(name, '/') != NULL || table->store.pool.attach_shm(shm_object(name, "").c_str(), fd >= 0) == false) {
+        perror("Не удалось подключить разделяемую память");
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
+    table->shm_name = name;
+    if (fd < 0)
+        return true;  // первый запуск (или прошлый процесс не успел сохранить описание) - ФС пустая
+
+    FILE *f = fdopen(fd, "r");
+    bool ok = shm_load(table, f);
+    fclose(f);
+    if (ok == false) {
+        fprintf(stderr, "Описание ФС в %s повреждено или записано другой версией; данные не тронуты - "
+                        "удалите /dev/shm/%s и /dev/shm/%s%s, чтобы начать с пустой ФС\n", meta.c_str(), name, name, SNAPSHOT_META_SUFFIX);
+        return false;
+    }
+    shm_unlink(meta.c_str());  // дальше байты начнут меняться - старое описание им уже не соответствует
+    fprintf(stderr, "ФС восстановлена из разделяемой памяти /%s: %zu байт данных\n", name, table->store.stored);
+    return true;
+}
+
+
+// === Наши ключи запуска (передаются через -o, остальные ключи достаются FUSE) ===
+struct tmpfs_config {
+    char *spill_path;  // -o spill=ПУТЬ: директория или файл, куда вытесняются холодные данные
+    char *spill_limit;  // -o spill_limit=РАЗМЕР: сколько данных держим в памяти, например 512M
+    char *cache_cap;  // -o cache_cap=РАЗМЕР: режим кэша - при превышении размера удаляем давно не использованные файлы
+    unsigned long cache_ttl;  // -o cache_ttl=СЕКУНДЫ: время жизни новых файлов
+    char *import;  // -o import=ПУТЬ: перед монтированием заполнить ФС содержимым директории или tar-архива ("-" - со стандартного ввода)
+    int index;  // -o index: вести индекс имён для поиска через FIND_PATH
+    unsigned long scrub;  // -o scrub=СЕКУНДЫ: фоновая проверка контрольных сумм - каждый кусок раз в столько секунд (0 - не проверять)
+    unsigned long changes;  // -o changes=N: сколько последних изменений хранит журнал CHANGES_PATH (0 - журнала нет)
+    char *shm;  // -o shm=ИМЯ: хранить данные в разделяемой памяти /dev/shm/ИМЯ, чтобы перезапуск процесса их не терял
+    char *backing;  // -o backing=ДИР: работать кэшем в памяти над директорией ДИР
+    unsigned long writeback;  // -o writeback=СЕКУНДЫ: как часто переносить изменённое содержимое в нижнюю директорию
+    unsigned long writeback_threads;  // -o writeback_threads=N: сколько потоков пишут в нижнюю директорию
+};
+
+#define TMPFS_OPT(t, p) { t, offsetof(struct tmpfs_config, p), 1 }
+static struct fuse_opt tmpfs_opts[] = {
+    TMPFS_OPT("spill=%s", spill_path),
+    TMPFS_OPT("spill_limit=%s", spill_limit),
+    TMPFS_OPT("cache_cap=%s", cache_cap),
+    TMPFS_OPT("cache_ttl=%lu", cache_ttl),
+    TMPFS_OPT("import=%s", import),
+    TMPFS_OPT("changes=%lu", changes),
+    TMPFS_OPT("index", index),
+    TMPFS_OPT("scrub=%lu", scrub),
+    TMPFS_OPT("shm=%s", shm),
+    TMPFS_OPT("backing=%s", backing),
+    TMPFS_OPT("writeback=%lu", writeback),
+    TMPFS_OPT("writeback_threads=%lu", writeback_threads),
+    FUSE_OPT_END
+};
+
+
 int main(int argc, char *argv[]) {
     int fuse_stat;
 
@@ -866,16 +2535,76 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    struct tmpfs_config conf;
+    memset(&conf, 0, sizeof(conf));
+    conf.changes = CHANGES_DEFAULT_RING;
+    conf.writeback = WB_DEFAULT_DELAY;
+    conf.writeback_threads = WB_DEFAULT_THREADS;
+    if (fuse_opt_parse(&args, &conf, tmpfs_opts, NULL) == -1) {
+        fprintf(stderr, "Ошибка разбора ключей запуска\n");
+        return 1;
+    }
+    fuse_opt_add_arg(&args, "-s");  // код рассчитан на один поток запросов (фоновые потоки синхронизируются с ним сами)
+
     TableInodes *tmpfs_data = new TableInodes;  // создаём струткуру для хранения всех inode 
     if (tmpfs_data == NULL) {
 	    perror("Ошибка основного malloc");
         return 1;
     }
+
+    if (conf.spill_path != NULL) {
+        size_t limit = 0;
+        if (conf.spill_limit == NULL || parse_size(conf.spill_limit, limit) == false) {
+            fprintf(stderr, "Для вытеснения нужно указать лимит памяти: -o spill=ПУТЬ,spill_limit=РАЗМЕР\n");
+            return 1;
+        }
+        if (tmpfs_data->store.enable_spill(conf.spill_path, limit) == false) {
+            perror("Не удалось открыть файл вытеснения");
+            return 1;
+        }
+    }
+    if (conf.cache_cap != NULL && parse_size(conf.cache_cap, tmpfs_data->cache_cap) == false) {
+        fprintf(stderr, "Некорректный размер кэша: -o cache_cap=РАЗМЕР\n");
+        return 1;
+    }
+    tmpfs_data->default_ttl = conf.cache_ttl;
+    if (conf.scrub > 0)
+        tmpfs_data->store.enable_scrub(conf.scrub);
+    tmpfs_data->changes.enable(conf.changes);  // импорт ниже идёт мимо обработчиков FUSE - в журнал он не попадает
+    name_index().enabled = conf.index != 0;  // до импорта: индекс заполняется по мере появления имён
+
+    if (conf.backing != NULL) {
+        char *root = realpath(conf.backing, NULL);  // fuse_main при уходе в фон меняет текущую директорию на /
+        struct stat st;
+        if (root == NULL || stat(root, &st) != 0 || S_ISDIR(st.st_mode) == 0 || conf.import != NULL) {
+            fprintf(stderr, "Нижняя директория %s не найдена (или указан import - с backing он не совместим)\n", conf.backing);
+            return 1;
+        }
+        tmpfs_data->overlay = new Overlay(root, conf.writeback, conf.writeback_threads);
+        free(root);
+        INODE *root_inode = tmpfs_data->inodes[0];  // корень - сама нижняя директория
+        root_inode->stub = true;
+        root_inode->mode = st.st_mode;
+        root_inode->uid = st.st_uid;
+        root_inode->gid = st.st_gid;
+        root_inode->st_atim = st.st_atim;
+        root_inode->st_mtim = st.st_mtim;
+        root_inode->st_ctim = st.st_ctim;
+    }
+
+    if (conf.shm != NULL && shm_restore(tmpfs_data, conf.shm) == false)  // до импорта: из пула ещё ничего не выделено
+        return 1;
+    if (conf.import != NULL && import_tree(tmpfs_data, conf.import) == false) {
+        fprintf(stderr, "Не удалось импортировать %s\n", conf.import);
+        return 1;
+    }
    
     // Передаём управление FUSE:
     fprintf(stderr, "about to call fuse_main\n");
-    fuse_stat = fuse_main(argc, argv, &tmpfs_oper, tmpfs_data);  // эта функция полностью оперирует файловой системе, вызывает функции, определенные в tmpds_oper, для команд над файловой системе
+    fuse_stat = fuse_main(args.argc, args.argv, &tmpfs_oper, tmpfs_data);  // эта функция полностью оперирует файловой системе, вызывает функции, определенные в tmpds_oper, для команд над файловой системе
     fprintf(stderr, "fuse_main returned %d\n", fuse_stat);
+    fuse_opt_free_args(&args);
     
     return fuse_stat;
-}
\ No newline at end of file
+}
@@ -0,0 +1,439 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <set>
+#include <map>
+#include <unordered_map>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+using namespace std;
+
+
+#define WB_DEFAULT_DELAY 1  // через сколько секунд после изменения данные уходят в нижнюю директорию
+#define WB_DEFAULT_THREADS 4  // сколько потоков записи
+#define WB_RETRY_DELAY 5  // через сколько секунд повторяем запись содержимого файла, которая не удалась (fsync повторяет сразу)
+#define WB_ZERO_SIZE ((size_t) 64 * 1024)  // сколько нулей пишем за раз, если дыру в нижнем файле нельзя пробить
+
+#define WB_CREATE 0  // создать пустой файл path с правами mode
+#define WB_MKDIR 1
+#define WB_UNLINK 2
+#define WB_RMDIR 3
+#define WB_RENAME 4  // path -> path2
+#define WB_LINK 5  // новая ссылка path2 на path
+#define WB_CHMOD 6
+#define WB_CHOWN 7  // без прав root чужой владелец не выставится - такую ошибку пропускаем
+#define WB_UTIMES 8
+#define WB_DATA 9  // содержимое файла: размер и изменённые куски
+
+
+
+// === Один кусок файла в задании на запись: поток записи читает bytes, пока задание не завершено ===
+struct wb_piece {
+    size_t index;  // номер куска: байты [index * chunk_size, (index + 1) * chunk_size)
+    const uint8_t *bytes;  // cap байт, дальше - нули; NULL - кусок стал дырой
+    size_t cap;
+    void *owner;  // закреплённый кусок (см. ChunkStore::pin); поток записи это поле не трогает
+};
+
+
+
+// === Задание для потоков записи: одно изменение пространства имён или новое содержимое одного файла ===
+struct wb_job {
+    int op;  // WB_*
+    string path;  // пути внутри ФС (от корня нижней директории), какими они были в момент постановки задания
+    string path2;
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+    struct timespec times[2];  // atime и mtime (для WB_CREATE, WB_MKDIR, WB_UTIMES и WB_DATA)
+
+    uint64_t seq;  // номер в порядке постановки (см. WriteBack::submit)
+    int num;  // WB_DATA: inode файла и номер его записи в Overlay::files
+    uint64_t serial;
+    size_t size;  // новый размер файла
+    size_t min_size;  // наименьший размер с прошлой записи: всё, что дальше, в нижнем файле сначала обрезаем
+    size_t chunk_size;
+    vector <wb_piece> pieces;
+
+    int err;  // результат: 0 или errno
+};
+
+
+
+// === Изменения одного файла, ещё не отданные потокам записи ===
+// Повторные записи в один и тот же кусок до следующего сброса - это одна запись в нижний файл
+struct wb_file {
+    set <size_t> chunks;  // номера изменённых кусков
+    size_t min_size;  // см. wb_job::min_size
+    bool resized;  // размер менялся
+    size_t jobs;  // сколько заданий с содержимым файла ещё не завершено - пока они есть, новое не отдаём (порядок записей)
+    uint64_t last_job;  // номер последнего отданного задания с содержимым (см. wb_job::seq) - его ждёт fsync файла
+    uint64_t serial;  // номер записи: номер inode мог освободиться и достаться другому файлу, пока задание было у потоков
+    time_t retry_at;  // прошлая запись не удалась: её изменения вернулись сюда, и раньше этого времени их не повторяем (0 - не было)
+    int error;  // первая ошибка записи файла после его прошлого fsync (0 - не было); пока её не получил fsync, запись не удаляем
+
+    wb_file() {
+        min_size = 0;
+        resized = false;
+        jobs = 0;
+        last_job = 0;
+        serial = 0;
+        retry_at = 0;
+        error = 0;
+    }
+
+    bool dirty() {
+        return chunks.size() > 0 || resized;
+    }
+
+    // Задание с содержимым файла не выполнено: всё, что оно должно было записать, снова считаем изменённым
+    void failed(const wb_job *job, time_t now) {
+        for (const wb_piece &piece: job->pieces)
+            chunks.insert(piece.index);
+        min_size = min(min_size, job->min_size);
+        resized = true;  // размер и времена тоже выставим заново
+        retry_at = now + WB_RETRY_DELAY;
+        if (error == 0)
+            error = job->err;
+    }
+};
+
+
+
+// === Потоки записи в нижнюю директорию ===
+// Задания выполняются в порядке постановки: изменение пространства имён выполняется одно (после завершения всех предыдущих
+// и до начала следующих), а задания с содержимым разных файлов между двумя такими изменениями - параллельно.
+// Содержимое одного файла не может оказаться в двух заданиях сразу (см. wb_file::jobs), поэтому записи одного файла не переставляются.
+struct WriteBack {
+    string root;  // нижняя директория
+    size_t threads;
+    vector <thread> workers;
+
+    mutex m;  // защищает всё ниже
+    condition_variable cv;
+    deque <wb_job*> todo;
+    map <uint64_t, wb_job*> unfinished;  // поставленные и ещё не выполненные задания по номерам (в очереди и у потоков)
+    uint64_t next_seq;
+    vector <wb_job*> done;
+    size_t running;  // сколько заданий выполняется
+    bool exclusive;  // выполняется изменение пространства имён
+    bool stop;
+
+    WriteBack(const string &_root, size_t _threads) {
+        root = _root;
+        threads = max(_threads, (size_t) 1);
+        running = 0;
+        next_seq = 1;
+        exclusive = false;
+        stop = false;
+    }
+
+    void start() {  // см. BufferPool::start
+        for (size_t i = workers.size(); i < threads; i ++)
+            workers.push_back(thread(&WriteBack::worker_loop, this));
+    }
+
+    uint64_t submit(wb_job *job) {  // возвращаем номер задания - его можно ждать (wait_job)
+        lock_guard <mutex> lock(m);
+        job->seq = next_seq ++;
+        todo.push_back(job);
+        unfinished[job->seq] = job;
+        cv.notify_all();
+        return job->seq;
+    }
+
+    void finished(wb_job *job) {  // под m
+        unfinished.erase(job->seq);
+        done.push_back(job);
+    }
+
+    vector <wb_job*> take_done() {
+        lock_guard <mutex> lock(m);
+        vector <wb_job*> res;
+        res.swap(done);
+        return res;
+    }
+
+    size_t queued() {
+        lock_guard <mutex> lock(m);
+        return todo.size() + running;
+    }
+
+    // Ждём, пока выполнится всё, что поставлено (fsync, чтение нижней директории); без потоков выполняем сами
+    void wait_idle() {
+        unique_lock <mutex> lock(m);
+        if (workers.size() == 0) {
+            while (todo.size() > 0) {
+                wb_job *job = todo.front();
+                todo.pop_front();
+                lock.unlock();
+                run(job);
+                lock.lock();
+                finished(job);
+            }
+            return;
+        }
+        cv.wait(lock, [this] { return todo.size() == 0 && running == 0; });
+    }
+
+    // Путь a - это путь b или одна из директорий на пути к нему
+    static bool path_within(const string &a, const string &b) {
+        return b.compare(0, a.size(), a) == 0 && (b.size() == a.size() || b[a.size()] == '/');
+    }
+
+    // Номер последнего невыполненного изменения пространства имён, которое касается пути path: самого пути, директорий на пути
+    // к нему или того, что внутри (0 - таких нет). Пока оно не выполнено, путь в нижней директории может не совпадать с нашим
+    uint64_t last_touching(const string &path) {
+        lock_guard <mutex> lock(m);
+        for (auto it = unfinished.rbegin(); it != unfinished.rend(); it ++) {
+            wb_job *job = it->second;
+            if (job->op == WB_DATA)
+                continue;
+            if (path_within(job->path, path) || path_within(path, job->path) ||
+                (job->path2.size() > 0 && (path_within(job->path2, path) || path_within(path, job->path2))))
+                return job->seq;
+        }
+        return 0;
+    }
+
+    // Ждём, пока выполнится задание seq (0 или уже выполненное - не ждём); без потоков выполняем очередь до него сами.
+    // В отличие от wait_idle задания, поставленные после него, не ждём
+    void wait_job(uint64_t seq) {
+        unique_lock <mutex> lock(m);
+        if (workers.size() == 0) {
+            while (unfinished.count(seq) > 0) {
+                wb_job *job = todo.front();
+                todo.pop_front();
+                lock.unlock();
+                run(job);
+                lock.lock();
+                finished(job);
+            }
+            return;
+        }
+        cv.wait(lock, [this, seq] { return unfinished.count(seq) == 0; });
+    }
+
+    bool can_start() {  // под m: можно ли начинать первое задание очереди
+        if (todo.size() == 0 || exclusive)
+            return false;
+        return todo.front()->op == WB_DATA || running == 0;
+    }
+
+    void worker_loop() {
+        while (1) {
+            wb_job *job;
+            {
+                unique_lock <mutex> lock(m);
+                cv.wait(lock, [this] { return (stop && todo.size() == 0) || can_start(); });
+                if (todo.size() == 0)
+                    return;  // stop и делать больше нечего
+                job = todo.front();
+                todo.pop_front();
+                running += 1;
+                exclusive = job->op != WB_DATA;
+            }
+
+            run(job);
+
+            lock_guard <mutex> lock(m);
+            running -= 1;
+            exclusive = false;
+            finished(job);
+            cv.notify_all();
+        }
+    }
+
+    // Останавливаем потоки (они успевают выполнить всё, что поставлено)
+    void shutdown() {
+        {
+            lock_guard <mutex> lock(m);
+            stop = true;
+            cv.notify_all();
+        }
+        for (thread &worker: workers)
+            worker.join();
+        workers.clear();
+        wait_idle();  // потоков не было - выполняем сами
+    }
+
+    ~WriteBack() {
+        shutdown();
+    }
+
+    // Зануляем байты [off, off + len) нижнего файла: пробиваем дыру, а если нельзя - пишем нули
+    static bool zero_range(int fd, off_t off, size_t len) {
+        if (len == 0 || fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, len) == 0)
+            return true;
+        static const vector <uint8_t> zeros(WB_ZERO_SIZE, 0);
+        for (size_t done = 0; done < len; ) {
+            ssize_t res = pwrite(fd, zeros.data(), min(len - done, WB_ZERO_SIZE), off + done);
+            if (res < 0 && errno == EINTR)
+                continue;
+            if (res <= 0)
+                return false;
+            done += res;
+        }
+        return true;
+    }
+
+    static bool write_all(int fd, const uint8_t *bytes, size_t len, off_t off) {
+        for (size_t done = 0; done < len; ) {
+            ssize_t res = pwrite(fd, bytes + done, len - done, off + done);
+            if (res < 0 && errno == EINTR)
+                continue;
+            if (res <= 0)
+                return false;
+            done += res;
+        }
+        return true;
+    }
+
+    // Открываем нижний файл на запись; если у файла нет права на запись (его создали с правами 0444) - временно его даём
+    static int open_for_write(const string &path) {
+        int fd = open(path.c_str(), O_WRONLY);
+        struct stat st;
+        if (fd >= 0 || errno != EACCES || stat(path.c_str(), &st) != 0 || chmod(path.c_str(), st.st_mode | S_IWUSR) != 0)
+            return fd;
+        fd = open(path.c_str(), O_WRONLY);
+        int err = errno;
+        chmod(path.c_str(), st.st_mode);
+        errno = err;
+        return fd;
+    }
+
+    bool write_data(wb_job *job, int fd) {
+        if ((job->min_size < job->size && ftruncate(fd, job->min_size) != 0) || ftruncate(fd, job->size) != 0)
+            return false;
+        for (wb_piece &piece: job->pieces) {
+            size_t off = piece.index * job->chunk_size;
+            if (off >= job->size)
+                continue;  // кусок отрезали после того, как он изменился
+            size_t len = min(job->chunk_size, job->size - off);
+            size_t have = piece.bytes != NULL ? min(len, piece.cap) : 0;
+            if (write_all(fd, piece.bytes, have, off) == false || zero_range(fd, off + have, len - have) == false)
+                return false;
+        }
+        return futimens(fd, job->times) == 0;
+    }
+
+    void run(wb_job *job) {
+        string path = root + job->path, path2 = root + job->path2;
+        bool ok = true;
+        int fd;
+        switch (job->op) {
+            case WB_CREATE:  // времена - как у нас, а не момент, когда до задания дошла очередь
+                fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, job->mode & 07777);
+                ok = fd >= 0 && futimens(fd, job->times) == 0;
+                if (fd >= 0 && close(fd) != 0)
+                    ok = false;
+                break;
+            case WB_MKDIR:
+                ok = mkdir(path.c_str(), job->mode & 07777) == 0 && utimensat(AT_FDCWD, path.c_str(), job->times, 0) == 0;
+                break;
+            case WB_UNLINK:
+                ok = unlink(path.c_str()) == 0;
+                break;
+            case WB_RMDIR:
+                ok = rmdir(path.c_str()) == 0;
+                break;
+            case WB_RENAME:
+                ok = rename(path.c_str(), path2.c_str()) == 0;
+                break;
+            case WB_LINK:
+                ok = link(path.c_str(), path2.c_str()) == 0;
+                break;
+            case WB_CHMOD:
+                ok = chmod(path.c_str(), job->mode & 07777) == 0;
+                break;
+            case WB_CHOWN:
+                ok = lchown(path.c_str(), job->uid, job->gid) == 0 || errno == EPERM;
+                break;
+            case WB_UTIMES:
+                ok = utimensat(AT_FDCWD, path.c_str(), job->times, AT_SYMLINK_NOFOLLOW) == 0;
+                break;
+            case WB_DATA:
+                fd = open_for_write(path);
+                ok = fd >= 0 && write_data(job, fd);
+                if (fd >= 0) {
+                    int err = errno;  // ошибку записи не затираем ошибкой close
+                    if (close(fd) != 0 && ok)
+                        ok = false;
+                    else
+                        errno = err;
+                }
+                break;
+        }
+        job->err = ok ? 0 : errno;
+    }
+};
+
+
+
+// === Режим кэша над нижней директорией: состояние, которое ведёт поток запросов ===
+struct Overlay {
+    WriteBack wb;
+    unordered_map <int, wb_file> files;  // номер inode -> изменения файла, ещё не записанные в нижнюю директорию
+    map <pair <dev_t, ino_t>, int> links;  // файл нижней директории с несколькими жёсткими ссылками -> наш inode (все его имена - одна inode)
+    unordered_map <int, pair <dev_t, ino_t>> link_keys;  // обратно: inode -> файл нижней директории
+    uint64_t next_serial;
+    time_t delay;  // см. WB_DEFAULT_DELAY; 0 - отдаём изменения в конце каждой операции
+    time_t last_flush;
+    int error;  // первая ошибка изменения пространства имён после прошлого fsync директории (0 - не было); ошибки содержимого - в wb_file
+    size_t loaded_dirs, loaded_files;  // сколько директорий и файлов прочитано из нижней директории
+    size_t dropped;  // сколько раз содержимое чистого файла выброшено из памяти (режим кэша)
+    size_t flushed_ops, flushed_bytes, errors;
+
+    Overlay(const string &root, time_t _delay, size_t threads) : wb(root, threads) {
+        next_serial = 1;
+        delay = _delay;
+        last_flush = 0;
+        error = 0;
+        loaded_dirs = loaded_files = dropped = 0;
+        flushed_ops = flushed_bytes = errors = 0;
+    }
+
+    void add_link(int num, dev_t dev, ino_t ino) {
+        links[{dev, ino}] = num;
+        link_keys[num] = {dev, ino};
+    }
+
+    void forget_link(int num) {  // inode освободилась
+        auto it = link_keys.find(num);
+        if (it == link_keys.end())
+            return;
+        links.erase(it->second);
+        link_keys.erase(it);
+    }
+
+    size_t dirty_files() {  // у скольких файлов есть изменения, которых ещё нет в нижней директории
+        size_t dirty = 0;
+        for (auto &file: files)
+            dirty += file.second.dirty() || file.second.jobs > 0 ? 1 : 0;
+        return dirty;
+    }
+
+    // Статистика для пользователя (см. атрибут user.tmpfs.writeback)
+    string stats() {
+        return "dirty_files=" + to_string(dirty_files()) +
+               " queued=" + to_string(wb.queued()) +
+               " flushed_ops=" + to_string(flushed_ops) +
+               " flushed_bytes=" + to_string(flushed_bytes) +
+               " errors=" + to_string(errors) +
+               " loaded_dirs=" + to_string(loaded_dirs) +
+               " loaded_files=" + to_string(loaded_files) +
+               " dropped=" + to_string(dropped) + "\n";
+    }
+};